@@ -0,0 +1,114 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#include "mocktransport.h"
+
+
+MockTransport::MockTransport(QObject *parent) : ScriptTransport(parent),
+    channel([this](const char *data, qint64 size) { received(data, size); }, this)
+{
+    deliverTimer.setSingleShot(true);
+    connect(&deliverTimer, &QTimer::timeout, this, [this]()
+    {
+        deliver(chunkSize);
+        scheduleDelivery();
+    });
+}
+
+void MockTransport::start()
+{
+    if (running || startPending)
+        return;
+    startPending = true;
+    startCount++;
+    scheduleDelivery();
+}
+
+void MockTransport::stop()
+{
+    deliverTimer.stop();
+    auto wasRunning = running;
+    running = startPending = false;
+    input.clear();
+    output.clear();
+    channel.input.clear();
+    if (wasRunning)
+        emit stopped();
+}
+
+bool MockTransport::deliver(qsizetype size)
+{
+    if (startPending)
+    {
+        startPending = false;
+        running = true;
+        emit started();
+        return true;
+    }
+    if (output.isEmpty())
+        return false;
+
+    // Script may write new requests while reading, which are answered after this piece
+    auto piece = size > 0 ? qMin<qsizetype>(size, output.size()) : output.size();
+    channel.input += output.left(piece);
+    output.remove(0, piece);
+    emit readyRead();
+    return true;
+}
+
+void MockTransport::received(const char *data, qint64 size)
+{
+    input.append(data, size);
+    qsizetype begin = 0;
+    for (auto end = input.indexOf('\n'); end >= 0; end = input.indexOf('\n', begin))
+    {
+        requestCount++;
+        if (running)
+            output += reply(input.mid(begin, end - begin)) + '\n';
+        begin = end + 1;
+    }
+    input.remove(0, begin);
+    scheduleDelivery();
+}
+
+QByteArray MockTransport::reply(const QByteArray &request) const
+{
+    if (request == "?")
+        return sensorNames.join('\t').toLocal8Bit();
+
+    auto separator = request.indexOf('\t');
+    auto target = QString::fromLocal8Bit(request.left(separator));
+    auto command = separator < 0 ? QByteArray() : request.mid(separator + 1);
+    if (target == "*")
+    {
+        if (command == "capabilities")
+            return capabilities.join('\t').toLocal8Bit();
+        if (command == "value")
+        {
+            QByteArrayList all;
+            for (const auto& sensorName : sensorNames)
+                all.append(values.value(sensorName));
+            return all.join('\t');
+        }
+        if (command == "interval")
+            return "0\t0";
+        if (command == "hash")
+            return sensorNames.join(',').toLocal8Bit();
+        return QByteArray(); // Tick and unknown commands
+    }
+
+    if (command == "value")
+        return values.value(target);
+    if (command == "variant_type")
+        return types.value(target); // Empty like a script without the parameter, the plugin defaults to QString
+    return QByteArray(); // Empty line for other parameters, which keeps their defaults, and for subscribe and unsubscribe notices
+}
+
+void MockTransport::scheduleDelivery()
+{
+    if (delay >= 0 && !isIdle() && !deliverTimer.isActive())
+        deliverTimer.start(delay);
+}
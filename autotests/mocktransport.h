@@ -0,0 +1,59 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#ifndef MOCKTRANSPORT_H
+#define MOCKTRANSPORT_H
+
+#include "transport.h"
+
+#include <QHash>
+#include <QStringList>
+#include <QTimer>
+
+
+// Script emulated in process, its output is held until delivered, so tests control when and in which pieces it arrives.
+// Supports the line based commands, not compact, shm or stream.
+class MockTransport : public ScriptTransport
+{
+    Q_OBJECT
+
+public:
+    explicit MockTransport(QObject *parent = nullptr);
+
+    QIODevice &device() override { return channel; }
+    void start() override; // Started is held like output, a process also reports it later
+    void stop() override;
+
+    // Emulated script, may be changed between requests
+    QStringList sensorNames;
+    QHash<QString, QByteArray> values;
+    QHash<QString, QByteArray> types; // Qt type name of sensors, the plugin default if missing
+    QStringList capabilities;
+
+    // Held output is delivered automatically after delay milliseconds in pieces of chunkSize bytes, if delay isn't negative
+    int delay = -1;
+    qsizetype chunkSize = 0; // 0 for all held output at once
+
+    bool deliver(qsizetype size = 0); // Delivers held start or up to size bytes of output, all for 0, false if nothing is held
+    bool isRunning() const { return running; }
+    bool isIdle() const { return !startPending && output.isEmpty(); } // Everything written so far was answered and delivered
+    int startCount = 0;
+    int requestCount = 0;
+
+private:
+    RelayDevice channel;
+    QByteArray input; // Written data not terminated by a newline yet
+    QByteArray output; // Replies not delivered yet
+    QTimer deliverTimer;
+    bool running = false;
+    bool startPending = false;
+
+    void received(const char *data, qint64 size);
+    QByteArray reply(const QByteArray &request) const;
+    void scheduleDelivery();
+};
+
+#endif
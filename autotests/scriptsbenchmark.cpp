@@ -0,0 +1,253 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#include "scripts.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+
+
+#ifdef __GLIBC__
+// Every allocation of the plugin process is counted, including the ones of Qt containers, which don't use operator new
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *memory, size_t size);
+
+static std::atomic<quint64> allocationCount = 0; // On all threads
+
+extern "C" void *malloc(size_t size) noexcept
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *memory, size_t size) noexcept
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(memory, size);
+}
+#endif
+
+
+// Runs the plugin without the daemon on copies of synthetic.c, timing init and update cycles of a single script
+class ScriptsBenchmark : public QObject
+{
+    Q_OBJECT
+
+private:
+    QTemporaryDir home; // Scripts folder, config and caches of the plugin
+    KSysGuard::SensorObject *script = nullptr; // Of the running plugin
+    int updatesFinished = 0;
+
+    QString scriptDirPath() const { return home.path() + "/.local/share/ksystemstats-scripts"; }
+    bool addScript(const QString &scriptName); // Fixture linked into the empty scripts folder
+    ScriptsPlugin *startPlugin(const QString &scriptName); // Returns once the script finished init, null if it didn't
+    void subscribeSensors(int sensorCount);
+    bool tick(ScriptsPlugin *plugin); // Plugin update, returns once the script finished updating
+    static bool waitFor(const std::function<bool()> &done);
+
+private slots:
+    void initTestCase();
+    void init();
+
+    void initTime_data();
+    void initTime();
+    void updates_data();
+    void updates();
+    void sensorLatency_data();
+    void sensorLatency();
+    void allocations_data();
+    void allocations();
+};
+
+
+bool ScriptsBenchmark::addScript(const QString &scriptName)
+{
+    return QFile::link(SYNTHETIC_PATH, scriptDirPath() + "/" + scriptName); // Script reads its parameters from its name
+}
+
+ScriptsPlugin *ScriptsBenchmark::startPlugin(const QString &scriptName)
+{
+    auto plugin = new ScriptsPlugin(nullptr, {});
+    script = plugin->containers().value(0)->object(scriptName);
+    if (!script || !waitFor([this]() { return script->sensor("ready_time")->value().isValid(); }))
+    {
+        delete plugin;
+        return nullptr;
+    }
+
+    updatesFinished = 0;
+    connect(script->sensor("update_latency"), &KSysGuard::SensorProperty::valueChanged, this, [this]() { updatesFinished++; });
+    return plugin;
+}
+
+void ScriptsBenchmark::subscribeSensors(int sensorCount)
+{
+    for (int i = 0; i < sensorCount; i++)
+        script->sensor("s" + QString::number(i))->subscribe();
+}
+
+bool ScriptsBenchmark::tick(ScriptsPlugin *plugin)
+{
+    auto finished = updatesFinished + 1;
+    plugin->update();
+    return waitFor([this, finished]() { return updatesFinished >= finished; });
+}
+
+bool ScriptsBenchmark::waitFor(const std::function<bool()> &done)
+{
+    // Unlike QTest::qWaitFor, doesn't sleep between checks, which would be most of a short update
+    QElapsedTimer timeout;
+    timeout.start();
+    while (!done())
+    {
+        if (timeout.elapsed() > 30000)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents); // Watchdog timer of the plugin wakes up every second
+    }
+    return true;
+}
+
+void ScriptsBenchmark::initTestCase()
+{
+    QVERIFY(home.isValid());
+    qputenv("HOME", QFile::encodeName(home.path())); // Scripts folder of the plugin is in the home folder
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+void ScriptsBenchmark::init()
+{
+    QDir(home.path()).removeRecursively();
+    QDir().mkpath(scriptDirPath());
+}
+
+static void addRows()
+{
+    QTest::addColumn<int>("sensorCount");
+    QTest::addColumn<QString>("scriptName");
+
+    for (auto sensorCount : { 1, 10, 100, 1000 })
+        for (auto capabilities : { "", "-value", "-pipeline", "-compact" })
+        {
+            auto scriptName = "synthetic-" + QString::number(sensorCount) + capabilities;
+            QTest::newRow(qPrintable(scriptName)) << sensorCount << scriptName;
+        }
+}
+
+void ScriptsBenchmark::initTime_data()
+{
+    addRows();
+}
+
+void ScriptsBenchmark::initTime()
+{
+    QFETCH(QString, scriptName);
+
+    // From creating the plugin until the script replied to all init requests, without cached sensors
+    QVERIFY(addScript(scriptName));
+    QBENCHMARK
+    {
+        QDir(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)).removeRecursively();
+        auto plugin = startPlugin(scriptName);
+        QVERIFY(plugin);
+        delete plugin;
+    }
+}
+
+void ScriptsBenchmark::updates_data()
+{
+    addRows();
+}
+
+void ScriptsBenchmark::updates()
+{
+    QFETCH(int, sensorCount);
+    QFETCH(QString, scriptName);
+
+    // Time of a plugin update until all watched sensors were polled, updates per second are its inverse
+    QVERIFY(addScript(scriptName));
+    QScopedPointer<ScriptsPlugin> plugin(startPlugin(scriptName));
+    QVERIFY(!plugin.isNull());
+    subscribeSensors(sensorCount);
+    QVERIFY(tick(plugin.data())); // First update also notifies the script of the subscriptions
+
+    QBENCHMARK
+    {
+        QVERIFY(tick(plugin.data()));
+    }
+}
+
+void ScriptsBenchmark::sensorLatency_data()
+{
+    addRows();
+}
+
+void ScriptsBenchmark::sensorLatency()
+{
+    QFETCH(int, sensorCount);
+    QFETCH(QString, scriptName);
+
+    // Update time divided by the polled sensors
+    QVERIFY(addScript(scriptName));
+    QScopedPointer<ScriptsPlugin> plugin(startPlugin(scriptName));
+    QVERIFY(!plugin.isNull());
+    subscribeSensors(sensorCount);
+    QVERIFY(tick(plugin.data()));
+
+    constexpr int ticks = 200;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < ticks; i++)
+        QVERIFY(tick(plugin.data()));
+    QTest::setBenchmarkResult(qreal(timer.nsecsElapsed()) / ticks / sensorCount, QTest::WalltimeNanoseconds);
+}
+
+void ScriptsBenchmark::allocations_data()
+{
+    addRows();
+}
+
+void ScriptsBenchmark::allocations()
+{
+#ifndef __GLIBC__
+    QSKIP("Allocations are only counted with glibc");
+#else
+    QFETCH(int, sensorCount);
+    QFETCH(QString, scriptName);
+
+    // Heap allocations of the plugin, the I/O thread and the event loop per update of all sensors
+    QVERIFY(addScript(scriptName));
+    QScopedPointer<ScriptsPlugin> plugin(startPlugin(scriptName));
+    QVERIFY(!plugin.isNull());
+    subscribeSensors(sensorCount);
+    for (int i = 0; i < 10; i++) // Reused buffers reach their size
+        QVERIFY(tick(plugin.data()));
+
+    constexpr int ticks = 200;
+    auto start = allocationCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < ticks; i++)
+        QVERIFY(tick(plugin.data()));
+    QTest::setBenchmarkResult(qreal(allocationCount.load(std::memory_order_relaxed) - start) / ticks, QTest::Events);
+#endif
+}
+
+
+QTEST_GUILESS_MAIN(ScriptsBenchmark)
+
+#include "scriptsbenchmark.moc"
@@ -0,0 +1,400 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#include "mocktransport.h"
+#include "scripts.h"
+
+#include <QRandomGenerator>
+#include <QTest>
+
+
+// Owner of the container scripts are created in, the plugin itself would start scripts from the scripts directory
+class TestPlugin : public KSysGuard::SensorPlugin
+{
+public:
+    TestPlugin() : SensorPlugin(nullptr, {}) {}
+    QString providerName() const override { return "test"; }
+};
+
+
+// Drives Script through its transport like the plugin does, with replies arriving in pieces and at chosen moments
+class ScriptsTest : public QObject
+{
+    Q_OBJECT
+
+private:
+    TestPlugin *plugin = nullptr;
+    MockTransport *transport = nullptr;
+    Script *script = nullptr;
+    int initializedCount = 0;
+    int failedCount = 0;
+    qint64 now = 0;
+
+    void createScript(const QString &capabilities);
+    void subscribeAll();
+    void pluginUpdate(); // Like ScriptsPlugin::update, one second after the last one
+    void deliverAll(qsizetype size = 0);
+    bool hasValues(const QHash<QString, QByteArray> &values, const QSet<QString> &sensorNames) const;
+
+private slots:
+    void cleanup();
+
+    void initialValues();
+    void takenIds();
+    void partialReplies_data();
+    void partialReplies();
+    void coalescedReplies_data();
+    void coalescedReplies();
+    void timedReplies();
+    void reloadDuringUpdate_data();
+    void reloadDuringUpdate();
+    void reloadDuringInit();
+    void stoppedDuringUpdate();
+    void stress_data();
+    void stress();
+};
+
+
+void ScriptsTest::createScript(const QString &capabilities)
+{
+    plugin = new TestPlugin;
+    auto container = new KSysGuard::SensorContainer("scripts", "Scripts", plugin);
+    transport = new MockTransport;
+    transport->sensorNames = QStringList { "text", "count", "load", "state" };
+    transport->values = { { "text", "a" }, { "count", "1" }, { "load", "0.5" }, { "state", "idle" } };
+    transport->types = { { "count", "int" }, { "load", "double" } };
+    transport->capabilities = capabilities.split('\t', Qt::SkipEmptyParts);
+
+    script = new Script("/nonexistent/mock.sh", "mock.sh", "Mock", transport, container); // Takes ownership of transport
+    initializedCount = failedCount = 0;
+    connect(script, &Script::initialized, this, [this]() { initializedCount++; });
+    connect(script, &Script::failed, this, [this]() { failedCount++; });
+    now = 0;
+}
+
+void ScriptsTest::subscribeAll()
+{
+    for (const auto& sensorName : qAsConst(transport->sensorNames))
+        script->sensor(sensorName)->subscribe();
+}
+
+void ScriptsTest::pluginUpdate()
+{
+    now += 1000;
+    script->setUpdatePeriod(1000);
+    script->publishValues();
+    if (script->isDue(now))
+        script->update(now);
+    script->publishChanges();
+}
+
+void ScriptsTest::deliverAll(qsizetype size)
+{
+    while (transport->deliver(size))
+        ;
+}
+
+bool ScriptsTest::hasValues(const QHash<QString, QByteArray> &values, const QSet<QString> &sensorNames) const
+{
+    for (const auto& sensorName : sensorNames)
+        if (script->sensor(sensorName)->value().toString().toLocal8Bit() != values.value(sensorName))
+        {
+            qWarning() << "Sensor" << sensorName << "is" << script->sensor(sensorName)->value() << "instead of" << values.value(sensorName);
+            return false;
+        }
+    return true;
+}
+
+void ScriptsTest::cleanup()
+{
+    delete plugin; // Deletes container, script and transport
+    plugin = nullptr;
+    script = nullptr;
+    transport = nullptr;
+}
+
+void ScriptsTest::initialValues()
+{
+    createScript("pipeline");
+    script->start();
+    deliverAll();
+
+    QCOMPARE(initializedCount, 1);
+    QCOMPARE(script->sensor("text")->value(), QVariant("a"));
+    QCOMPARE(script->sensor("count")->value(), QVariant(1));
+    QCOMPARE(script->sensor("load")->value(), QVariant(0.5));
+    QVERIFY(transport->isIdle());
+
+    // Nothing is polled until someone watches a sensor
+    auto requests = transport->requestCount;
+    pluginUpdate();
+    QCOMPARE(transport->requestCount, requests);
+}
+
+void ScriptsTest::takenIds()
+{
+    createScript("pipeline");
+    transport->sensorNames.append("restarts");
+    transport->values.insert("restarts", "many");
+    script->start();
+    deliverAll();
+
+    // Built-in sensor keeps its id, the script sensor is still requested under its own name
+    QCOMPARE(initializedCount, 1);
+    QVERIFY(script->sensor("restarts")->value() != QVariant("many"));
+    QCOMPARE(script->sensor("restarts_")->value(), QVariant("many"));
+    script->sensor("restarts_")->subscribe();
+    pluginUpdate();
+    deliverAll();
+    QCOMPARE(script->sensor("restarts_")->value(), QVariant("many"));
+    QVERIFY(transport->isIdle());
+}
+
+void ScriptsTest::partialReplies_data()
+{
+    QTest::addColumn<QString>("capabilities");
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("plain, bytes") << "" << 1;
+    QTest::newRow("pipeline, bytes") << "pipeline" << 1;
+    QTest::newRow("batch, bytes") << "value" << 1;
+    QTest::newRow("batch with tick, bytes") << "value\tpipeline\ttick" << 1;
+    QTest::newRow("pipeline, 3 bytes") << "pipeline" << 3;
+    QTest::newRow("subscribe, 5 bytes") << "subscribe\tpipeline\tinterval" << 5;
+}
+
+void ScriptsTest::partialReplies()
+{
+    QFETCH(QString, capabilities);
+    QFETCH(int, size);
+
+    createScript(capabilities);
+    script->start();
+    deliverAll(size);
+    QCOMPARE(initializedCount, 1);
+    subscribeAll();
+
+    const QSet<QString> all(transport->sensorNames.cbegin(), transport->sensorNames.cend());
+    for (int i = 0; i < 20; i++)
+    {
+        transport->values["text"] = "text " + QByteArray::number(i);
+        transport->values["count"] = QByteArray::number(i * 7);
+        auto values = transport->values;
+        pluginUpdate();
+        deliverAll(size);
+        QVERIFY(transport->isIdle());
+        pluginUpdate(); // Publishes the values and polls again
+        QVERIFY(hasValues(values, all));
+        deliverAll(size);
+    }
+    QCOMPARE(failedCount, 0);
+}
+
+void ScriptsTest::coalescedReplies_data()
+{
+    partialReplies_data(); // Piece size is not used
+}
+
+void ScriptsTest::coalescedReplies()
+{
+    QFETCH(QString, capabilities);
+
+    // Replies to all requests written so far arrive together, including ones of requests written while reading
+    createScript(capabilities);
+    script->start();
+    deliverAll();
+    QCOMPARE(initializedCount, 1);
+    subscribeAll();
+
+    const QSet<QString> all(transport->sensorNames.cbegin(), transport->sensorNames.cend());
+    for (int i = 0; i < 20; i++)
+    {
+        transport->values["state"] = i % 2 ? "busy" : "idle";
+        transport->values["load"] = QByteArray::number(i / 4.0);
+        auto values = transport->values;
+        pluginUpdate();
+        auto requests = transport->requestCount;
+        pluginUpdate(); // Update is still running, nothing may be written twice
+        QCOMPARE(transport->requestCount, requests);
+        deliverAll();
+        pluginUpdate();
+        QVERIFY(hasValues(values, all));
+        deliverAll();
+    }
+    QCOMPARE(failedCount, 0);
+}
+
+void ScriptsTest::timedReplies()
+{
+    // Replies come from the event loop in small pieces, as from a process
+    createScript("pipeline\tvalue");
+    transport->delay = 0;
+    transport->chunkSize = 4;
+    script->start();
+    QTRY_COMPARE(initializedCount, 1);
+    subscribeAll();
+
+    transport->values["text"] = "changed";
+    pluginUpdate();
+    QTRY_VERIFY(transport->isIdle());
+    pluginUpdate();
+    QCOMPARE(script->sensor("text")->value(), QVariant("changed"));
+}
+
+void ScriptsTest::reloadDuringUpdate_data()
+{
+    partialReplies_data();
+}
+
+void ScriptsTest::reloadDuringUpdate()
+{
+    QFETCH(QString, capabilities);
+    QFETCH(int, size);
+
+    createScript(capabilities);
+    script->start();
+    deliverAll();
+    subscribeAll();
+
+    // Restart in the middle of the replies of an update, the rest of the old output must not be taken for new replies
+    transport->values["text"] = "before";
+    pluginUpdate();
+    transport->deliver(size);
+    script->restart();
+    QCOMPARE(transport->startCount, 2);
+    transport->values["text"] = "after";
+    deliverAll(size);
+    QCOMPARE(initializedCount, 2);
+    QCOMPARE(script->sensor("text")->value(), QVariant("after")); // Value from init
+
+    // Interrupted update is never published, the next one is
+    transport->values["text"] = "updated";
+    pluginUpdate();
+    QCOMPARE(script->sensor("text")->value(), QVariant("after"));
+    deliverAll(size);
+    pluginUpdate();
+    QCOMPARE(script->sensor("text")->value(), QVariant("updated"));
+    QCOMPARE(failedCount, 0);
+}
+
+void ScriptsTest::reloadDuringInit()
+{
+    createScript("");
+    script->start();
+    for (int i = 0; i < 5; i++)
+        transport->deliver(3);
+    script->restart();
+    transport->sensorNames.append("added");
+    transport->values["added"] = "new";
+    deliverAll(3);
+
+    QCOMPARE(initializedCount, 1);
+    QCOMPARE(script->sensor("added")->value(), QVariant("new"));
+    QCOMPARE(script->sensor("text")->value(), QVariant("a"));
+}
+
+void ScriptsTest::stoppedDuringUpdate()
+{
+    createScript("pipeline");
+    transport->delay = 0;
+    script->start();
+    QTRY_COMPARE(initializedCount, 1);
+    subscribeAll();
+
+    // Values are cleared until the script is back, then polled again
+    transport->delay = -1;
+    pluginUpdate();
+    transport->deliver(2);
+    transport->stop();
+    QCOMPARE(failedCount, 1);
+    pluginUpdate();
+    QCOMPARE(script->sensor("text")->value(), QVariant());
+
+    transport->delay = 0;
+    QTRY_COMPARE_WITH_TIMEOUT(initializedCount, 2, 5000); // Restart delay
+    QCOMPARE(script->sensor("text")->value(), QVariant("a"));
+}
+
+void ScriptsTest::stress_data()
+{
+    QTest::addColumn<QString>("capabilities");
+
+    QTest::newRow("plain") << "";
+    QTest::newRow("pipeline") << "pipeline";
+    QTest::newRow("batch with tick") << "value\tpipeline\ttick";
+    QTest::newRow("subscribe") << "subscribe\tpipeline\tinterval";
+}
+
+void ScriptsTest::stress()
+{
+    QFETCH(QString, capabilities);
+
+    // Cycles per row, raised for longer runs
+    auto cycles = qEnvironmentVariableIntValue("KSYSTEMSTATS_SCRIPTS_STRESS_CYCLES");
+    if (cycles <= 0)
+        cycles = 250000;
+
+    createScript(capabilities);
+    script->start();
+    deliverAll();
+    subscribeAll();
+
+    // Same sequence in every run, so a failure can be reproduced
+    QRandomGenerator random(42);
+    const auto& sensorNames = transport->sensorNames;
+    QSet<QString> polled; // Watched in the update running since the last cycle
+    QHash<QString, QByteArray> values; // Answered in that update
+    auto verify = false; // That update ran to completion
+
+    for (int cycle = 0; cycle < cycles; cycle++)
+    {
+        // Change some values and watched sensors, both apply to the update started now
+        for (const auto& sensorName : sensorNames)
+            if (random.bounded(4) == 0)
+                transport->values[sensorName] = sensorName == "count" ? QByteArray::number(random.bounded(1000)) : QByteArray::number(random.bounded(1000) / 8.0);
+        if (random.bounded(32) == 0)
+        {
+            auto sensor = script->sensor(sensorNames[random.bounded(sensorNames.size())]);
+            if (sensor->isSubscribed())
+                sensor->unsubscribe();
+            else
+                sensor->subscribe();
+        }
+
+        auto lastPolled = std::exchange(polled, {});
+        for (const auto& sensorName : sensorNames)
+            if (script->sensor(sensorName)->isSubscribed())
+                polled.insert(sensorName);
+        auto lastValues = std::exchange(values, transport->values);
+
+        auto requests = transport->requestCount;
+        pluginUpdate(); // Publishes the last update and starts the next one
+        if (verify && !hasValues(lastValues, lastPolled))
+            QFAIL(qPrintable(QString("Wrong value after cycle %1").arg(cycle - 1)));
+        if (!polled.isEmpty() && transport->requestCount == requests)
+            QFAIL(qPrintable(QString("Script stopped polling in cycle %1").arg(cycle)));
+
+        // Deliver in pieces of random size, possibly restarting in between like after the script was modified
+        auto size = qsizetype(random.bounded(3) == 0 ? 0 : random.bounded(1, 24));
+        auto reloadAt = random.bounded(256) == 0 ? random.bounded(8) : -1; // Piece after which the script is restarted
+        auto reloaded = false;
+        for (int piece = 0; transport->deliver(size); piece++)
+            if (piece == reloadAt)
+            {
+                script->restart();
+                reloaded = true;
+            }
+        verify = !reloaded; // Restart drops the update, its values are never published
+        QCOMPARE(initializedCount, transport->startCount); // Every start finished init
+    }
+    QCOMPARE(failedCount, 0);
+    QCOMPARE(initializedCount, transport->startCount);
+}
+
+
+QTEST_GUILESS_MAIN(ScriptsTest)
+
+#include "scriptstest.moc"
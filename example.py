@@ -3,19 +3,31 @@
 import random
 import subprocess
 
+smi = ""  # Output of nvidia-smi, sampled once per update for all GPU sensors
+
+
+def smi_value(field):
+    for string in smi.split("\n"):
+        if field in string:
+            return string.split(":")[1].replace("%", "").replace("C", "").replace(" ", "")
+    return ""
+
+
 while True:
     req = input().strip().split("\t")
     if req[0] == "?":
-        print("gpu_fan_speed\tfrandom")
+        print("gpu_fan_speed\tgpu_temperature\tfrandom")
+    elif req[0] == "*":
+        if (req[1] == "capabilities"):
+            print("tick")
+        elif (req[1] == "tick"):
+            smi = subprocess.run(["nvidia-smi", "-q"], check=True, stdout=subprocess.PIPE).stdout.decode('utf-8')
+            print()
+        else:
+            print()
     elif req[0] == "gpu_fan_speed":
         if (req[1] == "value"):
-            stdout = subprocess.run(["nvidia-smi", "-q"], check=True, stdout=subprocess.PIPE).stdout.decode('utf-8')
-            for string in stdout.split("\n"):
-                if "Fan Speed" in string:
-                    print(string.split(":")[1].replace("%", "").replace(" ", ""))
-                    break
-            else:
-                print()
+            print(smi_value("Fan Speed"))
         elif (req[1] == "min"):
             print(0)
         elif (req[1] == "max"):
@@ -24,6 +36,13 @@ while True:
             print("%")
         else:
             print()
+    elif req[0] == "gpu_temperature":
+        if (req[1] == "value"):
+            print(smi_value("GPU Current Temp"))
+        elif (req[1] == "unit"):
+            print("C")
+        else:
+            print()
     elif req[0] == "frandom":
         if (req[1] == "value"):
             print(random.random())
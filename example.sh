@@ -1,19 +1,37 @@
 #!/usr/bin/env bash
 
 tab=$(printf '\t')
+settings="" # Output of nvidia-settings, sampled once per update for all sensors
+
+attribute() {
+    echo "$settings" | grep -i "Attribute '$1'" | cut -d : -f4 | cut -d . -f1 | cut -c2-
+}
+
 while :; do
     read query
     case "$query" in
         "?")
-            echo "gpu_fan_rpm"
+            echo "gpu_fan_rpm${tab}gpu_temperature"
+            ;;
+        "*${tab}capabilities")
+            echo "tick"
+            ;;
+        "*${tab}tick${tab}"*)
+            settings=$(nvidia-settings -q all)
+            echo
             ;;
         "gpu_fan_rpm${tab}value")
-            value=$(nvidia-settings -q all | grep  -i "Attribute 'GPUCurrentFanSpeedRPM'" | cut -d : -f4 | cut -d . -f1 | cut -c2-)
-            echo $value
+            attribute GPUCurrentFanSpeedRPM
             ;;
         "gpu_fan_rpm${tab}unit")
             echo "rpm"
             ;;
+        "gpu_temperature${tab}value")
+            attribute GPUCoreTemp
+            ;;
+        "gpu_temperature${tab}unit")
+            echo "C"
+            ;;
         *)
             echo
             ;;
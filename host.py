@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+
+# SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+# SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+
+# Runs Python scripts in threads of a single interpreter. Every line is prefixed by the path of the script it belongs
+# to, scripts are loaded by "*\tattach\t<path>", stopped by "*\tdetach\t<path>" and reported by "*\tdetached\t<path>"
+# when they exit by themselves.
+
+import runpy
+import sys
+import threading
+import traceback
+import queue
+
+lock = threading.Lock()  # Guards channels and writes to stdout
+channels = {}
+local = threading.local()
+stdin, stdout = sys.stdin, sys.stdout
+
+
+class Channel:
+    def __init__(self, path):
+        self.path = path
+        self.lines = queue.Queue()
+        self.pending = ""
+        self.closed = False
+
+
+def channel():
+    return getattr(local, "channel", None)
+
+
+# Replacements of sys.stdin and sys.stdout, which are forwarded to the channel of the calling thread
+class ChannelInput:
+    def readline(self, size=-1):
+        ch = channel()
+        return ch.lines.get() if ch else ""  # Empty string is EOF, input() raises EOFError
+
+    def __iter__(self):
+        return iter(self.readline, "")
+
+
+class ChannelOutput:
+    def write(self, text):
+        ch = channel()
+        if ch is None:
+            return sys.stderr.write(text)
+        *lines, ch.pending = (ch.pending + text).split("\n")
+        with lock:
+            if not ch.closed:
+                for line in lines:
+                    stdout.write(ch.path + "\t" + line + "\n")
+                stdout.flush()
+        return len(text)
+
+    def flush(self):
+        pass
+
+
+def run(ch):
+    local.channel = ch
+    try:
+        runpy.run_path(ch.path, run_name="__main__")
+    except (SystemExit, EOFError):
+        pass
+    except BaseException:
+        traceback.print_exc()
+    with lock:
+        if not ch.closed:
+            ch.closed = True
+            channels.pop(ch.path, None)
+            stdout.write("*\tdetached\t" + ch.path + "\n")
+            stdout.flush()
+
+
+def detach(path):
+    ch = channels.pop(path, None)
+    if ch:
+        ch.closed = True
+        ch.lines.put("")  # Wake up the script with EOF
+
+
+def attach(path):
+    with lock:
+        detach(path)
+        ch = channels[path] = Channel(path)
+    threading.Thread(target=run, args=(ch,), daemon=True).start()
+
+
+sys.stdin, sys.stdout = ChannelInput(), ChannelOutput()
+
+for line in stdin:
+    path, _, request = line.rstrip("\n").partition("\t")
+    if path == "*":
+        command, _, path = request.partition("\t")
+        if command == "attach":
+            attach(path)
+        elif command == "detach":
+            with lock:
+                detach(path)
+    else:
+        with lock:
+            ch = channels.get(path)
+        if ch:
+            ch.lines.put(request + "\n")
@@ -5,14 +5,60 @@
 */
 
 #include "scripts.h"
+#include "debug.h"
+#include "trace.h"
 #include <qdebug.h>
 #include <qdir.h>
 #include <qglobal.h>
 #include <qvariant.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QPointF>
+#include <QDateTime>
+#include <QFile>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 K_PLUGIN_CLASS_WITH_JSON(ScriptsPlugin, "metadata.json")
 
 
+static KSysGuard::Unit unitFromName(const QString &name)
+{
+    static const QMap<QString, KSysGuard::Unit> Str2Unit
+    {
+        { "-", KSysGuard::UnitNone },
+        { "B", KSysGuard::UnitByte },
+        { "B/s", KSysGuard::UnitByteRate },
+        { "Hz", KSysGuard::UnitHertz },
+        { "Timestamp", KSysGuard::UnitBootTimestamp },
+        { "s", KSysGuard::UnitSecond },
+        { "Time", KSysGuard::UnitTime },
+        { "Ticks", KSysGuard::UnitTicks },
+        { "C", KSysGuard::UnitCelsius },
+        { "b/s", KSysGuard::UnitBitRate },
+        { "dBm", KSysGuard::UnitDecibelMilliWatts },
+        { "%", KSysGuard::UnitPercent },
+        { "rate", KSysGuard::UnitRate },
+        { "rpm", KSysGuard::UnitRpm },
+        { "V", KSysGuard::UnitVolt },
+        { "W", KSysGuard::UnitWatt },
+        { "Wh", KSysGuard::UnitWattHour },
+        { "A", KSysGuard::UnitAmpere },
+    };
+
+    return Str2Unit.value(name, KSysGuard::UnitInvalid);
+}
+
+
 ScriptsPlugin::ScriptsPlugin(QObject *parent, const QVariantList &args) : SensorPlugin(parent, args)
 {
     container = new KSysGuard::SensorContainer("scripts", i18nc("@title", "Scripts"), this);
@@ -25,33 +71,290 @@ ScriptsPlugin::ScriptsPlugin(QObject *parent, const QVariantList &args) : Sensor
     scriptDirWatcher.addPath(scriptDirPath);
     connect(&scriptDirWatcher, &QFileSystemWatcher::directoryChanged, this, &ScriptsPlugin::directoryChanged);
 
+    // Check all scripts for missing replies with a single timer
+    watchdogTimer.setInterval(watchdogInterval);
+    connect(&watchdogTimer, &QTimer::timeout, this, [this]()
+    {
+        for (auto& script : qAsConst(scripts))
+            script->checkTimeout();
+    });
+    watchdogTimer.start();
+
+    // Register sensors from the cache right away, running scripts confirm them later
+    schemaSaveTimer.setSingleShot(true);
+    schemaSaveTimer.setInterval(1000);
+    connect(&schemaSaveTimer, &QTimer::timeout, this, &ScriptsPlugin::saveSchemaCache);
+    loadSchemaCache();
+
+    QSettings config(configPath, QSettings::IniFormat);
+    hostMode = config.value("General/HostMode", false).toBool();
+    maxStartingScripts = config.value("General/MaxConcurrentStarts", maxStartingScripts).toInt();
+    historyEnabled = config.value("General/History", false).toBool();
+    loadAggregates(config);
+
+    ioThread.setObjectName("ksystemstats-scripts-io");
+    ioThread.start();
+
+    updateClock.start();
     initScripts();
 }
 
+ScriptsPlugin::~ScriptsPlugin()
+{
+    if (schemaSaveTimer.isActive()) // Keep subscriptions of this session
+        saveSchemaCache();
+
+    // Transports are deleted on the I/O thread, which processes pending deletions once it quits
+    deinitScripts();
+    qDeleteAll(connections);
+    delete hostConnection;
+    ioThread.quit();
+    ioThread.wait();
+}
+
 void ScriptsPlugin::initScripts()
 {
-    auto scriptPathItr = QDirIterator(scriptDirPath, QDir::NoDotAndDotDot | QDir::Files | QDir::Executable, QDirIterator::Subdirectories);
-     QList<QString> addedScripts;
+    // Watch subdirectories too, as scripts in them are loaded as well
+    auto scriptDirItr = QDirIterator(scriptDirPath, QDir::NoDotAndDotDot | QDir::Dirs, QDirIterator::Subdirectories);
+    while (scriptDirItr.hasNext())
+    {
+        auto dirPath = scriptDirItr.next();
+        if (!scriptDirWatcher.directories().contains(dirPath))
+            scriptDirWatcher.addPath(dirPath);
+    }
+
+    auto scriptPathItr = QDirIterator(scriptDirPath, QDir::NoDotAndDotDot | QDir::Files, QDirIterator::Subdirectories);
+    QList<QString> addedScripts;
     while (scriptPathItr.hasNext())
     {
         auto scriptAbsPath = scriptPathItr.next();
+        auto isSocket = scriptPathItr.fileInfo().suffix() == "socket";
+        if (!isSocket && !scriptPathItr.fileInfo().isExecutable()) // Disabled script or other file
+            continue;
+
         auto scriptRelPath = QDir(scriptDirPath).relativeFilePath(scriptAbsPath); // Create relative path for hierarchical view in system monitor
-        auto scriptName = QFileInfo(scriptAbsPath).fileName();
         addedScripts.append(scriptRelPath);
         if (!scripts.contains(scriptRelPath)) // If loading new
-            scripts.insert(scriptRelPath, new Script(scriptAbsPath, scriptRelPath, scriptName, container));
-        else // If reloading
-            scripts[scriptRelPath]->restart();
+            addScript(scriptAbsPath, scriptRelPath);
+        else if (scripts[scriptRelPath]->fileChanged()) // If reloading modified
+        {
+            if (isSocket || scripts[scriptRelPath]->isHosted() != usesHost(scriptAbsPath)) // Socket path may have changed or limits were added or removed, create anew
+            {
+                removeScript(scriptRelPath);
+                addScript(scriptAbsPath, scriptRelPath);
+            }
+            else if (!startQueue.contains(scripts[scriptRelPath])) // Queued scripts start with the new file anyway
+                scripts[scriptRelPath]->restart();
+        }
+    }
+
+    for (const auto& script : scripts.keys())
+        if (!addedScripts.contains(script))
+        {
+            qCDebug(KSYSTEMSTATS_SCRIPTS) << "Deleting" << script;
+            removeScript(script);
+            if (schemaCache.remove(script))
+                schemaSaveTimer.start();
+        }
+}
+
+void ScriptsPlugin::addScript(const QString &scriptAbsPath, const QString &scriptRelPath)
+{
+    auto scriptName = QFileInfo(scriptAbsPath).fileName();
+    auto script = new Script(scriptAbsPath, scriptRelPath, scriptName, createTransport(scriptAbsPath), container);
+    script->setHistoryEnabled(historyEnabled);
+    script->loadSchema(schemaCache.value(scriptRelPath));
+    connect(script, &Script::initialized, this, [this, script, scriptRelPath]()
+    {
+        schemaCache.insert(scriptRelPath, script->schema());
+        schemaSaveTimer.start();
+        refreshAggregates();
+        startFinished(script);
+    });
+    connect(script, &Script::sensorsChanged, this, [this, script, scriptRelPath]()
+    {
+        schemaCache.insert(scriptRelPath, script->schema());
+        schemaSaveTimer.start();
+        refreshAggregates();
+    });
+    connect(script, &Script::failed, this, [this, script]() { startFinished(script); });
+    connect(script, &Script::firstSubscribed, this, [this]() { schemaSaveTimer.start(); });
+    scripts.insert(scriptRelPath, script);
+    refreshAggregates(); // Sensors from the cache
+    queueStart(script);
+}
+
+void ScriptsPlugin::removeScript(const QString &scriptRelPath)
+{
+    auto script = scripts.take(scriptRelPath);
+    container->removeObject(script);
+    startQueue.removeOne(script);
+    startFinished(script);
+    script->deleteLater();
+}
+
+// Sensors without a value, like the ones of a restarting script, are skipped instead of counting as 0
+static QVariant combineValid(const QVariant &first, const QVariant &second, double (*combine)(double, double))
+{
+    if (!first.isValid())
+        return second;
+    if (!second.isValid())
+        return first;
+    return combine(first.toDouble(), second.toDouble());
+}
+
+void ScriptsPlugin::loadAggregates(QSettings &config)
+{
+    static const QMap<QString, KSysGuard::AggregateSensor::AggregateFunction> functions
+    {
+        { "sum", [](QVariant first, QVariant second) { return combineValid(first, second, [](double a, double b) { return a + b; }); } },
+        { "avg", [](QVariant total, QVariant value) { return AverageSensor::accumulate(total, value); } },
+        { "max", [](QVariant first, QVariant second) { return combineValid(first, second, [](double a, double b) { return qMax(a, b); }); } },
+        { "min", [](QVariant first, QVariant second) { return combineValid(first, second, [](double a, double b) { return qMin(a, b); }); } },
+    };
+
+    for (const auto& group : config.childGroups())
+    {
+        if (!group.startsWith("Aggregate "))
+            continue;
+        config.beginGroup(group);
+        auto id = group.mid(strlen("Aggregate "));
+        auto function = config.value("Function", "sum").toString();
+        auto match = config.value("Sensors").toString();
+        if (match.startsWith("scripts/"))
+            match = match.mid(strlen("scripts/"));
+        auto separator = match.lastIndexOf('/');
+        if (separator < 0 || !functions.contains(function))
+        {
+            qCWarning(KSYSTEMSTATS_SCRIPTS) << "Invalid aggregate:" << id << "Sensors:" << match << "Function:" << function;
+            config.endGroup();
+            continue;
+        }
+
+        if (!aggregates)
+            aggregates = new KSysGuard::SensorObject("aggregates", i18nc("@title", "Aggregates"), container);
+        auto name = config.value("Name", id).toString();
+        auto sensor = function == "avg" ? new AverageSensor(aggregates, id, name) : new KSysGuard::AggregateSensor(aggregates, id, name);
+        sensor->setAggregateFunction(functions[function]);
+        sensor->setVariantType(QVariant::Double);
+        if (config.contains("Unit"))
+            sensor->setUnit(unitFromName(config.value("Unit").toString()));
+        aggregateSensors.append({ sensor, QRegularExpression(QRegularExpression::wildcardToRegularExpression(match.left(separator))), match.mid(separator + 1) });
+        config.endGroup();
+    }
+}
+
+void ScriptsPlugin::refreshAggregates()
+{
+    for (const auto& aggregate : qAsConst(aggregateSensors))
+        aggregate.sensor->setMatchSensors(aggregate.objects, aggregate.property);
+}
+
+void ScriptsPlugin::queueStart(Script *script)
+{
+    startQueue.append(script);
+    startQueued();
+}
+
+void ScriptsPlugin::startQueued()
+{
+    while (!startQueue.isEmpty() && (maxStartingScripts <= 0 || startingScripts.size() < maxStartingScripts))
+    {
+        // Scripts with sensors in use, now or in the last session, go first
+        auto next = std::find_if(startQueue.cbegin(), startQueue.cend(), [this](const Script *script)
+        {
+            return script->isSubscribed() || schemaCache.value(script->id()).subscribed;
+        });
+        auto script = next != startQueue.cend() ? *next : startQueue.first();
+        startQueue.removeOne(script);
+        startingScripts.insert(script);
+        script->start();
+    }
+}
+
+void ScriptsPlugin::startFinished(Script *script)
+{
+    if (startingScripts.remove(script)) // Restarts after failures don't wait in the queue
+        startQueued();
+}
+
+bool ScriptsPlugin::usesHost(const QString &scriptAbsPath) const
+{
+    return hostMode && isHostedScript(scriptAbsPath) && !QFile::exists(scriptAbsPath + ".limits"); // Limited scripts need their own process
+}
+
+ScriptTransport *ScriptsPlugin::createTransport(const QString &scriptAbsPath)
+{
+    if (usesHost(scriptAbsPath))
+    {
+        // Scripts are identified by their path in the host, which loads them when they are attached
+        if (!hostConnection)
+            hostConnection = new MuxConnection(new ThreadedTransport(new ProcessTransport(SCRIPTS_HOST_PATH), &ioThread), true, this);
+        return new MuxTransport(hostConnection, scriptAbsPath);
+    }
+    if (QFileInfo(scriptAbsPath).suffix() != "socket")
+        return new ThreadedTransport(new ProcessTransport(scriptAbsPath), &ioThread); // Limits are set by the script on every start
+
+    // Socket descriptor, optionally sharing a connection with other descriptors using the same socket
+    QSettings descriptor(scriptAbsPath, QSettings::IniFormat);
+    auto socketPath = descriptor.value("Socket/Path").toString();
+    auto group = descriptor.value("Socket/Group").toString();
+    if (group.isEmpty())
+        return new ThreadedTransport(new SocketTransport(socketPath), &ioThread);
+
+    auto &connection = connections[socketPath];
+    if (!connection)
+        connection = new MuxConnection(new ThreadedTransport(new SocketTransport(socketPath), &ioThread), false, this);
+    return new MuxTransport(connection, group);
+}
+
+bool ScriptsPlugin::isHostedScript(const QString &scriptAbsPath)
+{
+    QFile file(scriptAbsPath);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    auto shebang = file.readLine(256);
+    return shebang.startsWith("#!") && shebang.contains("python") && !shebang.contains("python2");
+}
+
+void ScriptsPlugin::loadSchemaCache()
+{
+    QFile file(schemaCachePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_15);
+    quint32 version;
+    stream >> version;
+    if (version != schemaCacheVersion) // Ignore cache of other plugin versions
+        return;
+    stream >> schemaCache;
+    if (stream.status() != QDataStream::Ok)
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Invalid schema cache:" << schemaCachePath;
+        schemaCache.clear();
+    }
+}
+
+void ScriptsPlugin::saveSchemaCache()
+{
+    QDir().mkpath(QFileInfo(schemaCachePath).path());
+    QSaveFile file(schemaCachePath);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Can't write schema cache:" << schemaCachePath << file.errorString();
+        return;
     }
-    // Ignore deleted for now
-    //
-    // for (const auto& script : scripts.keys())
-    //     if (!addedScripts.contains(script))
-    //     {
-    //         qDebug() << "Deleting" << script;
-    //         delete scripts[script];
-    //         scripts.remove(script);
-    //     }
+
+    for (auto schema = schemaCache.begin(); schema != schemaCache.end(); ++schema)
+        if (auto script = scripts.value(schema.key()))
+            schema->subscribed = script->wasSubscribed();
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << schemaCacheVersion << schemaCache;
+    file.commit();
 }
 
 void ScriptsPlugin::deinitScripts()
@@ -62,72 +365,301 @@ void ScriptsPlugin::deinitScripts()
 
 void ScriptsPlugin::update()
 {
-    qDebug() << "Update called";
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Update called";
+
+    // Look half an update period ahead, so intervals that are multiples of it aren't delayed by jitter
+    auto elapsed = updateClock.elapsed();
+    auto period = elapsed - lastUpdate;
+    auto now = elapsed + period / 2;
+    lastUpdate = elapsed;
+
     for (auto& script : qAsConst(scripts))
-        script->update();
+    {
+        script->setUpdatePeriod(period);
+        script->publishValues(); // Replies received since the last update, before backoff decides what is due
+        script->updateProcessStats();
+        if (script->isDue(now))
+            script->update(now);
+        script->publishChanges(); // Clients are sent all changes of this update at once
+    }
+}
+
+void ScriptsPlugin::dumpTrace()
+{
+    QHash<quint32, QString> scriptIds;
+    for (const auto& script : qAsConst(scripts))
+        scriptIds.insert(script->traceId, script->id());
+    if (Trace::dump(traceDumpPath, scriptIds))
+        qCInfo(KSYSTEMSTATS_SCRIPTS) << "Trace written to" << traceDumpPath;
 }
 
 void ScriptsPlugin::directoryChanged(const QString& path)
 {
     Q_UNUSED(path)
-    qDebug() << "Directory changed";
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Directory changed";
+    if (QFile::exists(traceTriggerPath)) // Trace requested, removing the trigger changes the directory again
+    {
+        QFile::remove(traceTriggerPath);
+        dumpTrace();
+    }
     initScripts(); // Reload scripts
 }
 
 
-Script::Script(const QString &scriptAbsPath, const QString &scriptRelPath, const QString &scriptName, KSysGuard::SensorContainer *parent) : KSysGuard::SensorObject(scriptRelPath, scriptName, parent)
+static KSysGuard::SensorProperty *createStatsProperty(const QString &id, const QString &name, const QString &description, KSysGuard::Unit unit, QVariant::Type type, KSysGuard::SensorObject *parent)
+{
+    auto property = new KSysGuard::SensorProperty(id, name, parent);
+    property->setDescription(description);
+    property->setUnit(unit);
+    property->setVariantType(type);
+    return property;
+}
+
+Script::Script(const QString &scriptAbsPath, const QString &scriptRelPath, const QString &scriptName, ScriptTransport *transport, KSysGuard::SensorContainer *parent) : KSysGuard::SensorObject(scriptRelPath, scriptName, parent), traceId(Trace::nextScriptId()), transport(transport)
 {
     scriptPath = scriptAbsPath;
+    scriptFile = ScriptFile::fromPath(scriptPath); // Compared with cached schema before the script is started
+    limitsFile = ScriptFile::fromPath(scriptPath + ".limits");
+    transport->setParent(this);
 
-    qDebug() << "Script:" << this->id() << "Path:" << scriptPath;
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Path:" << scriptPath;
 
     auto n = new KSysGuard::SensorProperty("name", i18nc("@title", "Name"), this->name(), this);
     n->setVariantType(QVariant::String);
+    readyTime = new KSysGuard::SensorProperty("ready_time", i18nc("@title", "Time to Ready"), this);
+    readyTime->setDescription(i18nc("@info", "Time from queueing or restarting the script until it replied to all init requests"));
+    readyTime->setUnit(KSysGuard::UnitSecond);
+    readyTime->setVariantType(QVariant::Double);
+    readyTimer.start();
+
+    updateLatency = createStatsProperty("update_latency", i18nc("@title", "Update Latency"), i18nc("@info", "Time the last update of sensor values took"), KSysGuard::UnitSecond, QVariant::Double, this);
+    roundTripMedian = createStatsProperty("round_trip_p50", i18nc("@title", "Median Round Trip"), i18nc("@info", "Median time from writing a request until its reply, over the last 128 requests"), KSysGuard::UnitSecond, QVariant::Double, this);
+    roundTripP99 = createStatsProperty("round_trip_p99", i18nc("@title", "99th Percentile Round Trip"), i18nc("@info", "Time from writing a request until its reply, exceeded by 1% of the last 128 requests"), KSysGuard::UnitSecond, QVariant::Double, this);
+    requestsPerUpdate = createStatsProperty("requests_per_update", i18nc("@title", "Requests per Update"), i18nc("@info", "Requests written to the script in the last update"), KSysGuard::UnitNone, QVariant::Int, this);
+    conversionFailures = createStatsProperty("conversion_failures", i18nc("@title", "Conversion Failures"), i18nc("@info", "Values that couldn't be converted to the type of their sensor"), KSysGuard::UnitNone, QVariant::Int, this);
+    restarts = createStatsProperty("restarts", i18nc("@title", "Restarts"), i18nc("@info", "Times the script was restarted after failing or being modified"), KSysGuard::UnitNone, QVariant::Int, this);
+    memory = createStatsProperty("rss", i18nc("@title", "Memory"), i18nc("@info", "Resident memory of the script process"), KSysGuard::UnitByte, QVariant::LongLong, this);
+    cpuUsage = createStatsProperty("cpu", i18nc("@title", "CPU Usage"), i18nc("@info", "CPU time used by the script process, as a share of one core"), KSysGuard::UnitPercent, QVariant::Double, this);
+    niceLevel = createStatsProperty("nice", i18nc("@title", "Nice Level"), i18nc("@info", "CPU scheduling priority of the script process, higher is lower priority"), KSysGuard::UnitNone, QVariant::Int, this);
+    ioPriority = createStatsProperty("io_priority", i18nc("@title", "I/O Priority"), i18nc("@info", "I/O scheduling class and level of the script process"), KSysGuard::UnitNone, QVariant::String, this);
+    cpuAffinity = createStatsProperty("cpu_affinity", i18nc("@title", "CPU Affinity"), i18nc("@info", "CPUs the script process may run on, empty for all"), KSysGuard::UnitNone, QVariant::String, this);
+    memoryMax = createStatsProperty("memory_max", i18nc("@title", "Memory Limit"), i18nc("@info", "Memory limit of the cgroup of the script process, empty if unlimited"), KSysGuard::UnitByte, QVariant::LongLong, this);
+    cpuQuota = createStatsProperty("cpu_quota", i18nc("@title", "CPU Quota"), i18nc("@info", "CPU time limit of the cgroup of the script process, as a share of one core, empty if unlimited"), KSysGuard::UnitPercent, QVariant::Double, this);
+    conversionFailures->setValue(0);
+    restarts->setValue(0);
+    statsClock.start();
 
-    connect(&scriptProcess, &QProcess::readyReadStandardOutput, this, &Script::readyReadStandardOutput);
-    connect(&scriptProcess, &QProcess::stateChanged, this, &Script::stateChanged);
-    scriptProcess.start(scriptPath, {});
+    restartTimer.setSingleShot(true);
+    connect(&restartTimer, &QTimer::timeout, this, &Script::start);
+
+    connect(transport, &ScriptTransport::readyRead, this, &Script::readyReadStandardOutput);
+    connect(transport, &ScriptTransport::started, this, &Script::transportStarted);
+    connect(transport, &ScriptTransport::stopped, this, &Script::transportStopped);
 }
 
 Script::~Script()
 {
-    scriptProcess.close();
-    if (initSensorAct) initSensorsH.destroy();
-    if (updateSensorsAct) updateSensorsH.destroy();
+    stop();
+}
+
+void Script::start()
+{
+    if (!readyTimer.isValid())
+        readyTimer.start();
+    scriptFile = ScriptFile::fromPath(scriptPath);
+    limitsFile = ScriptFile::fromPath(scriptPath + ".limits");
+    transport->setLimits(ProcessLimits::fromFile(scriptPath + ".limits"));
+    transport->start();
+}
+
+bool Script::fileChanged() const
+{
+    return ScriptFile::fromPath(scriptPath) != scriptFile || ScriptFile::fromPath(scriptPath + ".limits") != limitsFile;
+}
+
+void Script::loadSchema(const ScriptSchema &schema)
+{
+    if (schema.file != scriptFile || !sensorById.isEmpty()) // Script was modified since the schema was cached
+        return;
+
+    for (const auto& sensor : schema.sensors)
+        sensors.append(createSensor(sensor.first, sensor.second));
+    indexSensors();
+    sensorSchema = schema;
+}
+
+void Script::stop()
+{
+    stopping = true;
+    transport->stop();
+    stopping = false;
+
+    initTask.cancel();
+    updateTask.cancel();
+    ready = false;
+    pendingReplies.clear();
+    firstTicket = nextTicket;
+    streaming = false;
+    compactValues = false;
+    hashSensors = rescanPending = false;
+    nextHashCheck = 0;
+    if (sharedPage)
+    {
+        sharedFile.unmap(const_cast<uchar*>(sharedPage));
+        sharedFile.close();
+        sharedPage = nullptr;
+    }
+    interval = maxInterval = 0;
+    backoff = 1; unchangedUpdates = 0;
+    snapshot.reset(0); // Indices of sensors may change with the next init
+    scriptOutput.clear();
+    requestTimes.clear();
+    memory->setValue(QVariant());
+    cpuUsage->setValue(QVariant());
+    for (auto& property : { niceLevel, ioPriority, cpuAffinity, memoryMax, cpuQuota })
+        property->setValue(QVariant());
 }
 
 void Script::restart()
 {
-    scriptProcess.close();
-    if (initSensorAct) initSensorsH.destroy();
-    if (updateSensorsAct) updateSensorsH.destroy();
-    initSensorAct = false; updateSensorsAct = false;
-    scriptProcess.start(scriptPath, {});
+    stop();
+    restartTimer.stop();
+    restartDelay = initialRestartDelay;
+    readyTimer.start();
+    restarts->setValue(++restartCount);
+    start();
+}
+
+void Script::scheduleRestart()
+{
+    stop();
+
+    // Keep last values from being shown as current
+    for (auto& sensor : qAsConst(sensors))
+        sensor->clearValue();
+
+    qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Restarting in" << restartDelay << "ms";
+    restartTimer.start(restartDelay);
+    restartDelay = qMin(restartDelay * 2, maxRestartDelay);
+    restarts->setValue(++restartCount);
+    emit failed();
 }
 
-void Script::stateChanged(QProcess::ProcessState newState)
+quint64 Script::expectReply(qint32 sensor, qsizetype bytes)
 {
-    qDebug() << "Script:" << this->id() << "State:" << newState;
-    if (newState == QProcess::ProcessState::Running)
-        initSensors(&initSensorsH);
+    Trace::record(Trace::Request, traceId, quint32(nextTicket), sensor, quint32(bytes));
+    pendingReplies.enqueue({ nullptr, 0, sensor });
+    return nextTicket++;
 }
 
-void Script::readyReadStandardOutput()
+bool Script::replyAvailable(quint64 ticket, qsizetype size)
+{
+    if (ticket != firstTicket) // Earlier replies weren't taken yet
+        return false;
+    return size ? scriptOutput.size() >= size : scriptOutput.hasLine();
+}
+
+void Script::awaitReply(quint64 ticket, qsizetype size, std::coroutine_handle<> waiter)
+{
+    auto &pending = pendingReplies[ticket - firstTicket];
+    pending.waiter = waiter;
+    pending.size = size;
+}
+
+void Script::replyTaken(qsizetype bytes)
+{
+    Trace::record(Trace::Reply, traceId, quint32(firstTicket), pendingReplies.dequeue().sensor, quint32(bytes));
+    firstTicket++;
+}
+
+qint32 Script::sensorIndex(const QString &sensorId) const
+{
+    auto sensor = sensorById.value(sensorId);
+    return sensor && sensor->active ? sensor->index : -1;
+}
+
+void Script::indexSensors()
+{
+    for (int i = 0; i < sensors.size(); i++)
+        sensors[i]->index = i;
+}
+
+void Script::resumeWaiting()
+{
+    while (!pendingReplies.isEmpty() && pendingReplies.head().waiter && replyAvailable(firstTicket, pendingReplies.head().size))
+        std::exchange(pendingReplies.head().waiter, nullptr).resume();
+
+    finishTask(initTask);
+    finishTask(updateTask);
+}
+
+void Script::finishTask(Task &task)
+{
+    if (!task.isFinished())
+        return;
+    if (task.finish()) // Plugin is built without exception handling, the exception only tells that the task failed
+    {
+        qCCritical(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Failed";
+        scheduleRestart();
+    }
+}
+
+void Script::checkTimeout()
 {
-    scriptReply = scriptProcess.readAll().trimmed(); // Read all of script output and remove newline
-    qDebug() << "Script:" << this->id()  << "Received: " << scriptReply;
+    if (!pendingReplies.isEmpty() && replyTimer.elapsed() > requestTimeout)
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Didn't reply in" << requestTimeout << "ms";
+        scheduleRestart();
+    }
+}
+
+void Script::transportStarted()
+{
+    Trace::record(Trace::Started, traceId);
+    if (initTask.isRunning() || ready) // Already initializing or initialized in this run
+        return;
+    initTask = initSensors();
+    initTask.start();
+    resumeWaiting();
+}
 
-    if (initSensorAct) // If not initialized, continue init coroutine
-        initSensorsH();
-    else if (updateSensorsAct) // If initialized and update in progress, continue update coroutine
-        updateSensorsH();
+void Script::transportStopped()
+{
+    Trace::record(Trace::Stopped, traceId);
+    if (!stopping)
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Stopped unexpectedly";
+        scheduleRestart();
+    }
 }
 
-Coroutine Script::initSensors(std::coroutine_handle<> *h)
+void Script::readyReadStandardOutput()
 {
-    initSensorAct = true;
+    Trace::record(Trace::Read, traceId, 0, -1, quint32(transport->device().bytesAvailable()));
+    scriptOutput.readFrom(transport->device());
+    replyTimer.start();
+    replyTime = statsClock.nsecsElapsed() - (ScriptTransport::monotonicTime() - transport->arrivalTime()); // When it arrived, the main thread may be late
+
+    // Continue init or update coroutines once per received reply
+    resumeWaiting();
+
+    // Apply values sent by streaming script
+    if (streaming && pendingReplies.isEmpty())
+        while (scriptOutput.hasLine())
+            applyStreamedValue(scriptOutput.takeLine());
+
+    // Drop output nobody is waiting for
+    if (pendingReplies.isEmpty())
+        while (scriptOutput.hasLine())
+        {
+            auto line = scriptOutput.takeLine();
+            qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Unexpected:" << QByteArray(line.data(), line.size());
+        }
+}
 
-    Request r{h, this};
+Task Script::initSensors(bool rescan)
+{
+    Request r{this};
 
     QMap<QString, QString> sensorParameters
     {
@@ -140,107 +672,1174 @@ Coroutine Script::initSensors(std::coroutine_handle<> *h)
         { "max", "" },
         { "unit", "" },
         { "variant_type", "" },
+        { "kind", "" },
         { "value", "" },
     };
-    const QMap<QString, KSysGuard::Unit> Str2Unit
-    {
-        { "-", KSysGuard::UnitNone },
-        { "B", KSysGuard::UnitByte },
-        { "B/s", KSysGuard::UnitByteRate },
-        { "Hz", KSysGuard::UnitHertz },
-        { "Timestamp", KSysGuard::UnitBootTimestamp },
-        { "s", KSysGuard::UnitSecond },
-        { "Time", KSysGuard::UnitTime },
-        { "Ticks", KSysGuard::UnitTicks },
-        { "C", KSysGuard::UnitCelsius },
-        { "b/s", KSysGuard::UnitBitRate },
-        { "dBm", KSysGuard::UnitDecibelMilliWatts },
-        { "%", KSysGuard::UnitPercent },
-        { "rate", KSysGuard::UnitRate },
-        { "rpm", KSysGuard::UnitRpm },
-        { "V", KSysGuard::UnitVolt },
-        { "W", KSysGuard::UnitWatt },
-        { "Wh", KSysGuard::UnitWattHour },
-        { "A", KSysGuard::UnitAmpere },
-    };
 
     auto sensorNames = (co_await *r.request("?")).split("\t");
-    qDebug() << sensorNames;
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << sensorNames;
+    sensors.clear(); // Sensors from previous run are reused by createSensor
+    ScriptSchema schema { scriptFile, false, {} };
+
+    // Sensors still reported keep their parameters on rescan, only new ones are queried
+    QHash<QString, QMap<QString, QString>> knownParameters;
+    if (rescan)
+        for (const auto& sensor : qAsConst(sensorSchema.sensors))
+            if (sensorById.contains(sensor.first) && sensorById[sensor.first]->active)
+                knownParameters.insert(sensor.first, sensor.second);
+    QStringList queriedNames;
     for (const auto& sensorName : qAsConst(sensorNames))
+        if (!knownParameters.contains(sensorName))
+            queriedNames.append(sensorName);
+
+    // Query optional protocol extensions, scripts without them reply with an empty line
+    if (!rescan)
+    {
+        capabilities = (co_await *r.request("*", "capabilities")).split("\t");
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Capabilities:" << capabilities;
+        batchValues = capabilities.contains("value");
+        notifySubscriptions = capabilities.contains("subscribe");
+        pipelineRequests = capabilities.contains("pipeline");
+        streamValues = capabilities.contains("stream");
+        tickUpdates = capabilities.contains("tick");
+        hashSensors = capabilities.contains("hash") && !streamValues;
+    }
+
+    // Request update interval of script and its sensors
+    if (capabilities.contains("interval"))
     {
-        for (const auto& sensorParameter : sensorParameters.keys())
-            sensorParameters[sensorParameter] = co_await *r.request(sensorName, sensorParameter);
+        if (!rescan)
+        {
+            auto intervals = (co_await *r.request("*", "interval")).split("\t");
+            interval = qRound64(intervals.value(0).toDouble() * 1000);
+            maxInterval = qRound64(intervals.value(1).toDouble() * 1000);
+        }
+        sensorParameters.insert("interval", "");
+    }
 
-        auto variant_type = QVariant::Type::String;
-        auto sensor = new KSysGuard::SensorProperty(
-            sensorName,
-            sensorParameters["name"] == "" ? sensorName : sensorParameters["name"],
-            QVariant(sensorParameters["initial_value"]),
-            this);
-        if (sensorParameters["short_name"] != "") sensor->setShortName(sensorParameters["short_name"]);
-        if (sensorParameters["prefix"] != "") sensor->setPrefix(sensorParameters["prefix"]);
-        if (sensorParameters["description"] != "") sensor->setDescription(sensorParameters["description"]);
-        if (sensorParameters["min"] != "") sensor->setMin(sensorParameters["min"].toDouble());
-        if (sensorParameters["max"] != "") sensor->setMax(sensorParameters["max"].toDouble());
-        if (sensorParameters["unit"] != "")
+    // Request parameters of all sensors with a single command
+    QJsonObject description;
+    if (capabilities.contains("describe") && !queriedNames.isEmpty())
+    {
+        QJsonParseError error;
+        auto document = QJsonDocument::fromJson((co_await *r.request("*", "describe")).toUtf8(), &error);
+        if (error.error == QJsonParseError::NoError && document.isObject())
+            description = document.object();
+        else
+            qCCritical(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Invalid describe reply:" << error.errorString();
+    }
+
+    // Write all parameter requests at once, replies are read in order below
+    if (description.isEmpty() && pipelineRequests)
+    {
+        QList<QPair<QString, QString>> requests;
+        for (const auto& sensorName : qAsConst(queriedNames))
+            for (const auto& sensorParameter : sensorParameters.keys())
+                requests.append({ sensorName, sensorParameter });
+        r.requestAll(requests);
+    }
+
+    for (const auto& sensorName : qAsConst(sensorNames))
+    {
+        if (knownParameters.contains(sensorName))
         {
-            auto unit = KSysGuard::UnitInvalid;
-            if (Str2Unit.contains(sensorParameters["unit"]))
-                unit = Str2Unit[sensorParameters["unit"]];
-            sensor->setUnit(unit);
+            sensors.append(sensorById[sensorName]);
+            schema.sensors.append({ sensorName, knownParameters[sensorName] });
+            continue;
         }
-        if (sensorParameters["variant_type"] != "")
+        if (!description.isEmpty())
         {
-            variant_type = QVariant::nameToType(sensorParameters["variant_type"].toLocal8Bit().constData());
-            sensor->setVariantType(variant_type);
+            auto sensorDescription = description.value(sensorName).toObject();
+            for (const auto& sensorParameter : sensorParameters.keys())
+                sensorParameters[sensorParameter] = sensorDescription.value(sensorParameter).toVariant().toString();
+        }
+        else if (pipelineRequests)
+        {
+            for (const auto& sensorParameter : sensorParameters.keys())
+                sensorParameters[sensorParameter] = co_await *r.next();
+        }
+        else // Fall back to requesting each parameter separately
+        {
+            for (const auto& sensorParameter : sensorParameters.keys())
+                sensorParameters[sensorParameter] = co_await *r.request(sensorName, sensorParameter);
         }
 
-        // Implicitly convert QVariant to variant_type, because ksystemsensor seems to ignore setVariantType
-        QVariant value(sensorParameters["value"]);
-        if (!value.convert(variant_type))
-            qCritical() << "Script:" << this->id() << "Sensor:" << sensor->id() << "Value:" << sensorParameters["value"] << "can't be converted to" << variant_type;
-        sensor->setValue(value);
+        sensors.append(createSensor(sensorName, sensorParameters));
 
-        sensors.append(sensor);
+        auto cachedParameters = sensorParameters;
+        cachedParameters.remove("value"); // Current value is only valid in this run
+        schema.sensors.append({ sensorName, cachedParameters });
     }
 
-    initSensorAct = false;
-}
+    indexSensors();
 
-void Script::update()
-{
-    if (!updateSensorsAct && !initSensorAct) // If not already running update
-        updateSensors(&updateSensorsH);
-}
+    // Sensors can't be removed from the object, keep the ones not reported anymore without a value
+    for (auto& sensor : qAsConst(sensorById))
+        if (!sensors.contains(sensor))
+        {
+            sensor->active = false;
+            sensor->clearValue();
+        }
 
-Coroutine Script::updateSensors(std::coroutine_handle<> *h)
-{
-    updateSensorsAct = true;
+    // Script considers all sensors unsubscribed after init, report the ones already in use
+    if (notifySubscriptions)
+        for (const auto& sensorName : qAsConst(queriedNames))
+            if (sensorById[sensorName]->isSubscribed())
+                subscriptionChanges[sensorName] = true;
 
-    Request r{h, this};
-    for (auto& sensor : qAsConst(sensors))
+    // Remember the sensor set, updates compare it to notice sensors added or removed by script
+    if (hashSensors && !rescan)
+        sensorHash = co_await *r.request("*", "hash");
+    if (rescan)
     {
-        auto value_str = co_await *r.request(sensor->id(), "value");
-        QVariant value(value_str);
-        if (!value.convert(sensor->value().type()))
-            qCritical() << "Script:" << this->id() << "Sensor:" << sensor->id() << "Value:" << value_str << "can't be converted to" << sensor->value().type();
-        sensor->setValue(value); // If convert failed value is zero
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Rescanned sensors:" << queriedNames;
+        sensorSchema = schema;
+        snapshot.reset(sensors.size()); // Indices may have moved
+        publishChanges();
+        emit sensorsChanged();
+        co_return;
     }
 
-    updateSensorsAct = false;
-}
+    // Read values from shared memory if all sensors are numeric, fall back to requesting them if mapping fails
+    auto numeric = std::all_of(sensors.cbegin(), sensors.cend(), [](const ScriptSensor *sensor) { return sensor->isNumeric(); });
+    if (capabilities.contains("shm") && !streamValues && numeric)
+        mapSharedPage(co_await *r.request("*", "shm"));
+    if (sharedPage) // Nothing is requested anymore
+        hashSensors = false;
 
+    // Switch to binary values if all sensors are numeric and fit the 2 byte indices, from now on nothing else is requested
+    if (capabilities.contains("compact") && !streamValues && !sharedPage && numeric && sensors.size() <= 65536 && !transport->isMultiplexed())
+    {
+        co_await *r.request("*", "compact");
+        compactValues = true;
+        notifySubscriptions = false;
+        subscriptionChanges.clear(); // Text requests can't be written anymore
+        hashSensors = false;
+    }
 
-Request* Request::request(QString request0, QString request1)
-{
-    qDebug() << "Script:" << script->id() << "Requested:" << request0 + (request1 == "" ? QString("") : "\t" + request1);
-    script->scriptProcess.write((request0 + (request1 == "" ? QString("") : "\t" + request1) + "\n").toLocal8Bit());
-    return this;
+    restartDelay = initialRestartDelay; // Script works, start over if it fails later
+    sensorSchema = schema;
+    snapshot.reset(sensors.size());
+    ready = true;
+    if (readyTimer.isValid())
+    {
+        readyTime->setValue(readyTimer.elapsed() / 1000.0);
+        readyTimer.invalidate();
+    }
+    publishRoundTrips();
+    publishChanges(); // Initial values
+    emit initialized();
+
+    // Switch to streaming, from now on script sends values on its own
+    if (streamValues)
+    {
+        QByteArray data;
+        const auto changes = std::exchange(subscriptionChanges, {});
+        for (auto change = changes.constBegin(); change != changes.constEnd(); change++)
+            data += (change.key() + (change.value() ? "\tsubscribe\n" : "\tunsubscribe\n")).toLocal8Bit();
+        transport->device().write(data + "*\tstream\n");
+        streaming = true;
+    }
 }
 
-QString Request::await_resume() noexcept
+ScriptSensor *Script::createSensor(const QString &sensorName, const QMap<QString, QString> &sensorParameters)
 {
-    return script->scriptReply;
-}
+    auto variant_type = QVariant::Type::String;
+    auto sensor = sensorById.value(sensorName);
+    if (!sensor)
+    {
+        // Built-in sensors and histories share the id space of the object, a script sensor with a taken id gets another one
+        auto propertyId = sensorName;
+        while (this->sensor(propertyId) || (historyEnabled && this->sensor(propertyId + "_history")))
+            propertyId += "_";
+        if (propertyId != sensorName)
+            qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Sensor:" << sensorName << "Renamed to" << propertyId << "because the id is taken";
+
+        sensor = new ScriptSensor(
+            propertyId,
+            sensorParameters["name"] == "" ? sensorName : sensorParameters["name"],
+            QVariant(sensorParameters["initial_value"]),
+            this);
+        sensor->reportedId = sensorName;
+        sensorById.insert(sensorName, sensor);
+
+        // Remember subscription changes to send them to script on next update
+        connect(sensor, &KSysGuard::SensorProperty::subscribedChanged, this, [this, sensor](bool subscribed)
+        {
+            if (subscribed && !std::exchange(everSubscribed, true))
+                emit firstSubscribed();
+            if (!notifySubscriptions || !sensor->active)
+                return;
+            if (streaming) // Nothing to wait for, write immediately
+                transport->device().write((sensor->reportedId + (subscribed ? "\tsubscribe\n" : "\tunsubscribe\n")).toLocal8Bit());
+            else
+                subscriptionChanges[sensor->reportedId] = subscribed;
+        });
+    }
+    else // Reused from previous run
+        sensor->setName(sensorParameters["name"] == "" ? sensorName : sensorParameters["name"]);
+    sensor->active = true;
+    sensor->interval = 0;
+    sensor->setCounter(sensorParameters["kind"] == "counter");
+    if (sensorParameters["short_name"] != "") sensor->setShortName(sensorParameters["short_name"]);
+    if (sensorParameters["prefix"] != "") sensor->setPrefix(sensorParameters["prefix"]);
+    if (sensorParameters["description"] != "") sensor->setDescription(sensorParameters["description"]);
+    if (sensorParameters["min"] != "") sensor->setMin(sensorParameters["min"].toDouble());
+    if (sensorParameters["max"] != "") sensor->setMax(sensorParameters["max"].toDouble());
+    if (sensorParameters["interval"] != "") sensor->interval = qRound64(sensorParameters["interval"].toDouble() * 1000);
+    if (sensorParameters["unit"] != "")
+        sensor->setUnit(unitFromName(sensorParameters["unit"]));
+    if (sensorParameters["variant_type"] != "")
+    {
+        variant_type = QVariant::nameToType(sensorParameters["variant_type"].toLocal8Bit().constData());
+        sensor->setVariantType(variant_type);
+    }
+    if (sensor->isCounter()) // Rate of the counter is reported instead
+        sensor->setVariantType(QVariant::Double);
+
+    // Implicitly convert QVariant to variant_type, because ksystemsensor seems to ignore setVariantType
+    sensor->setValueType(variant_type);
+    if (historyEnabled && sensor->isNumeric() && !sensor->history && !this->sensor(sensor->id() + "_history"))
+        sensor->history = new HistoryProperty(sensor->id() + "_history", i18nc("@title", "%1 History", sensor->name()), statsClock, this);
+    if (sensorParameters.contains("value")) // Not known for sensors loaded from cache
+    {
+        auto value = sensorParameters["value"].toLocal8Bit();
+        setSensorValue(sensor, std::string_view(value.constData(), value.size()), replyTime);
+    }
+
+    return sensor;
+}
+
+bool Script::isSubscribed() const
+{
+    return std::any_of(sensors.cbegin(), sensors.cend(), [](const ScriptSensor *sensor) { return sensor->isSubscribed(); });
+}
+
+bool Script::isDue(qint64 now) const
+{
+    if (!ready || streaming) // Script isn't initialized or sends values on its own
+        return false;
+    if (!subscriptionChanges.isEmpty() || rescanPending) // Script needs to be notified or asked for sensors
+        return true;
+    if (hashSensors && now >= nextHashCheck) // Sensors may be added while none is watched
+        return true;
+    for (const auto& sensor : qAsConst(sensors))
+        if (sensor->isSubscribed() && now >= sensor->nextUpdate) // Don't poll sensors nobody is watching
+            return true;
+    return false;
+}
+
+void Script::update(qint64 now)
+{
+    if (sharedPage) // No need to ask script
+        readSharedPage();
+    else if (rescanPending && !updateTask.isRunning() && !initTask.isRunning())
+    {
+        rescanPending = false;
+        initTask = initSensors(true);
+        initTask.start();
+        resumeWaiting();
+    }
+    else if (!updateTask.isRunning() && !initTask.isRunning()) // If not already running update
+    {
+        updateTask = updateSensors(now);
+        updateTask.start();
+        resumeWaiting();
+    }
+}
+
+bool Script::mapSharedPage(const QString &path)
+{
+    sharedFile.setFileName(path);
+    if (!sharedFile.open(QIODevice::ReadOnly))
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Can't open shared page:" << path << sharedFile.errorString();
+        return false;
+    }
+
+    auto size = qsizetype(sizeof(SharedPage) + sizeof(double) * sensors.size());
+    auto page = sharedFile.size() >= size ? sharedFile.map(0, size) : nullptr;
+    auto header = reinterpret_cast<const SharedPage*>(page);
+    if (!header || header->magic != SharedPage::Magic || header->count != quint32(sensors.size()))
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Invalid shared page:" << path;
+        if (page) sharedFile.unmap(page);
+        sharedFile.close();
+        return false;
+    }
+
+    sharedPage = page;
+    sharedValues.resize(sensors.size());
+    sharedSequence = 1; // Never matches a complete write, so first read always applies values
+    return true;
+}
+
+void Script::readSharedPage()
+{
+    auto header = reinterpret_cast<const SharedPage*>(sharedPage);
+    std::atomic_ref<quint32> sequence(const_cast<quint32&>(header->sequence));
+
+    for (int attempt = 0; attempt < sharedPageAttempts; attempt++)
+    {
+        auto sequenceBefore = sequence.load(std::memory_order_acquire);
+        if (sequenceBefore == sharedSequence) // Nothing was written since last read
+            return;
+        if (sequenceBefore & 1) // Script is writing
+            continue;
+
+        memcpy(sharedValues.data(), sharedPage + sizeof(SharedPage), sizeof(double) * sharedValues.size());
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence.load(std::memory_order_relaxed) != sequenceBefore) // Values were torn by a concurrent write
+            continue;
+
+        sharedSequence = sequenceBefore;
+        auto time = statsClock.nsecsElapsed();
+        for (int i = 0; i < sensors.size(); i++)
+            if (sensors[i]->isSubscribed() && sensors[i]->updateValue(sharedValues[i], time))
+                valuesChanged = true;
+        return;
+    }
+}
+
+qint64 Script::sensorInterval(const ScriptSensor *sensor) const
+{
+    auto baseInterval = sensor->interval ? sensor->interval : interval;
+    if (!baseInterval && backoff > 1) // Backing off from polling on every plugin update
+        baseInterval = updatePeriod;
+    auto limit = qMax(baseInterval, maxInterval);
+    if (baseInterval > 0 && backoff > limit / baseInterval) // Product would exceed the limit, or overflow
+        return limit;
+    return baseInterval * backoff;
+}
+
+Task Script::updateSensors(qint64 now)
+{
+    updateRequests = 0;
+    auto updateStart = statsClock.nsecsElapsed();
+    snapshot.begin();
+    Trace::record(Trace::UpdateStarted, traceId);
+
+    Request r{this};
+
+    const auto changes = std::exchange(subscriptionChanges, {});
+    for (auto change = changes.constBegin(); change != changes.constEnd(); change++)
+        co_await *r.request(change.key(), change.value() ? "subscribe" : "unsubscribe");
+
+    // Rescan sensors before polling them if script reports a different set
+    if (hashSensors && now >= nextHashCheck)
+    {
+        nextHashCheck = now + hashInterval;
+        auto hash = co_await *r.request("*", "hash");
+        if (hash != sensorHash)
+        {
+            sensorHash = hash;
+            rescanPending = true;
+            co_return;
+        }
+    }
+
+    // Select sensors due for update and schedule the next one
+    QList<int> polledSensors; // Indices in sensors
+    for (int i = 0; i < sensors.size(); i++)
+    {
+        auto sensor = sensors[i];
+        sensor->due = sensor->isSubscribed() && now >= sensor->nextUpdate;
+        if (sensor->due)
+        {
+            polledSensors.append(i);
+            sensor->nextUpdate = now + sensorInterval(sensor);
+        }
+    }
+
+    // Let script sample its sources once for all sensors polled in this update
+    auto tickPending = tickUpdates && !compactValues && !polledSensors.isEmpty();
+    if (tickPending)
+        r.request("*", "tick\t" + QString::number(++tickGeneration));
+    if (tickPending && !pipelineRequests) // Pipelining script gets value requests right away
+    {
+        co_await *r.next();
+        tickPending = false;
+    }
+
+    if (compactValues && !polledSensors.isEmpty()) // Write sensor indices and read values in binary
+    {
+        QByteArray data(polledSensors.size() * sizeof(quint16), Qt::Uninitialized);
+        for (int i = 0; i < polledSensors.size(); i++)
+            qToLittleEndian<quint16>(polledSensors[i], data.data() + sizeof(quint16) * i);
+        r.requestBinary(data);
+
+        auto values = co_await r.binary(polledSensors.size() * sizeof(double));
+        for (int i = 0; i < polledSensors.size(); i++)
+        {
+            double value;
+            auto bits = qFromLittleEndian<quint64>(values.data() + sizeof(double) * i);
+            memcpy(&value, &bits, sizeof(double));
+            snapshot.setNumber(polledSensors[i], value, replyTime);
+        }
+    }
+    else if (batchValues && !polledSensors.isEmpty()) // Request all values with a single command
+    {
+        r.request("*", "value");
+        if (tickPending)
+            co_await *r.next();
+        auto values = co_await r.raw();
+        int valueCount = 0;
+        for (size_t begin = 0; begin <= values.size(); valueCount++)
+        {
+            auto end = qMin(values.find('\t', begin), values.size());
+            if (valueCount < sensors.size() && sensors[valueCount]->due)
+                snapshot.setText(valueCount, values.substr(begin, end - begin), replyTime);
+            begin = end + 1;
+        }
+        if (valueCount != sensors.size())
+        {
+            qCCritical(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Received" << valueCount << "values for" << sensors.size() << "sensors";
+            conversionFailures->setValue(++conversionFailureCount);
+        }
+    }
+    else if (pipelineRequests) // Write all value requests at once and read replies in order
+    {
+        QList<QPair<QString, QString>> requests;
+        for (auto index : qAsConst(polledSensors))
+            requests.append({ sensors[index]->reportedId, "value" });
+        r.requestAll(requests);
+        if (tickPending)
+            co_await *r.next();
+        for (auto index : qAsConst(polledSensors))
+            snapshot.setText(index, co_await r.raw(), replyTime);
+    }
+    else
+    {
+        for (auto index : qAsConst(polledSensors))
+            snapshot.setText(index, co_await r.request(sensors[index]->reportedId, "value")->raw(), replyTime);
+    }
+
+    // Values are applied by the next plugin update, an update cut short by a restart is never published
+    snapshot.commit();
+    Trace::record(Trace::UpdateFinished, traceId, 0, -1, quint32(updateRequests));
+
+    updateLatency->setValue((statsClock.nsecsElapsed() - updateStart) / 1e9);
+    requestsPerUpdate->setValue(updateRequests);
+    publishRoundTrips();
+}
+
+void Script::publishChanges()
+{
+    for (auto& sensor : qAsConst(sensorById))
+        sensor->publish();
+}
+
+void Script::publishValues()
+{
+    auto values = snapshot.take();
+    if (!values)
+        return;
+
+    valuesChanged = false;
+    auto polled = false;
+    for (int i = 0; i < values->size() && i < sensors.size(); i++)
+    {
+        const auto& value = values->at(i);
+        if (!value.received)
+            continue;
+        polled = true;
+        if (value.numeric)
+        {
+            if (sensors[i]->updateValue(value.number, value.time))
+                valuesChanged = true;
+        }
+        else
+            setSensorValue(sensors[i], std::string_view(value.text.constData(), value.text.size()), value.time);
+    }
+
+    // Back off when values stop changing, until maxInterval is reached
+    if (valuesChanged)
+    {
+        backoff = 1;
+        unchangedUpdates = 0;
+    }
+    else if (polled && ++unchangedUpdates >= backoffUpdates)
+    {
+        // Stop doubling once the longest interval reached the limit, shorter ones are capped by sensorInterval
+        auto longest = qMax(interval, updatePeriod);
+        for (const auto& sensor : qAsConst(sensors))
+            longest = qMax(longest, sensor->interval);
+        if (backoff < maxInterval / qMax<qint64>(longest, 1))
+            backoff *= 2;
+        unchangedUpdates = 0;
+    }
+}
+
+void Script::applyStreamedValue(std::string_view line)
+{
+    auto separator = line.find('\t');
+    if (separator == std::string_view::npos) // Ignore empty replies to notifications
+        return;
+
+    auto sensorName = QString::fromLocal8Bit(line.data(), separator);
+    if (sensorName == "+" || sensorName == "-")
+    {
+        changeStreamedSensor(sensorName == "+", line.substr(separator + 1));
+        return;
+    }
+    auto sensor = sensorById.value(sensorName);
+    if (!sensor || !sensor->active)
+    {
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Streamed unknown sensor:" << sensorName;
+        return;
+    }
+    setSensorValue(sensor, line.substr(separator + 1), replyTime); // Kept even if unwatched, script may not send it again soon
+}
+
+void Script::changeStreamedSensor(bool add, std::string_view line)
+{
+    auto separator = qMin(line.find('\t'), line.size());
+    auto sensorName = QString::fromLocal8Bit(line.data(), separator);
+    auto sensor = sensorById.value(sensorName);
+    auto removed = std::remove_if(sensorSchema.sensors.begin(), sensorSchema.sensors.end(), [&sensorName](const auto &cached) { return cached.first == sensorName; });
+    sensorSchema.sensors.erase(removed, sensorSchema.sensors.end());
+
+    if (!add)
+    {
+        if (!sensor || !sensor->active)
+            return;
+        sensor->active = false;
+        sensor->clearValue();
+        sensors.removeOne(sensor);
+        indexSensors();
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Removed sensor:" << sensorName;
+        emit sensorsChanged();
+        return;
+    }
+
+    // Parameters as in a reply to "*\tdescribe" for a single sensor
+    QMap<QString, QString> sensorParameters;
+    if (separator < line.size())
+    {
+        QJsonParseError error;
+        auto document = QJsonDocument::fromJson(QByteArray(line.data() + separator + 1, line.size() - separator - 1), &error);
+        if (error.error != QJsonParseError::NoError || !document.isObject())
+            qCCritical(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Invalid parameters of added sensor:" << sensorName << error.errorString();
+        const auto parameters = document.object();
+        for (const auto& sensorParameter : parameters.keys())
+            sensorParameters.insert(sensorParameter, parameters.value(sensorParameter).toVariant().toString());
+    }
+
+    auto wasActive = sensor && sensor->active;
+    sensor = createSensor(sensorName, sensorParameters);
+    if (!wasActive)
+    {
+        sensor->index = sensors.size();
+        sensors.append(sensor);
+    }
+    if (!wasActive && notifySubscriptions && sensor->isSubscribed()) // Subscribed while it was removed
+        transport->device().write((sensorName + "\tsubscribe\n").toLocal8Bit());
+    sensorParameters.remove("value");
+    sensorSchema.sensors.append({ sensorName, sensorParameters });
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Added sensor:" << sensorName;
+    emit sensorsChanged();
+}
+
+void Script::setSensorValue(ScriptSensor *sensor, std::string_view valueStr, qint64 time)
+{
+    bool ok = true;
+    if (sensor->updateValue(valueStr, ok, time))
+        valuesChanged = true;
+    if (!ok)
+    {
+        qCCritical(KSYSTEMSTATS_SCRIPTS) << "Script:" << this->id() << "Sensor:" << sensor->id() << "Value:" << QByteArray(valueStr.data(), valueStr.size()) << "can't be converted to" << sensor->valueType();
+        conversionFailures->setValue(++conversionFailureCount);
+    }
+}
+
+
+void Script::requestsWritten(int count)
+{
+    auto now = statsClock.nsecsElapsed();
+    for (int i = 0; i < count; i++)
+        requestTimes.enqueue(now);
+    updateRequests += count;
+    replyTimer.start();
+}
+
+void Script::replyReceived()
+{
+    if (requestTimes.isEmpty()) // Reply to a notification written without a request
+        return;
+    roundTrips[roundTripCount++ % roundTrips.size()] = replyTime - requestTimes.dequeue();
+}
+
+void Script::publishRoundTrips()
+{
+    if (!roundTripCount)
+        return;
+    auto samples = roundTrips;
+    auto end = samples.begin() + qMin<qsizetype>(roundTripCount, samples.size());
+    auto median = samples.begin() + (end - samples.begin()) / 2;
+    auto p99 = samples.begin() + (end - samples.begin()) * 99 / 100;
+    std::nth_element(samples.begin(), median, end);
+    roundTripMedian->setValue(*median / 1e9);
+    std::nth_element(median, p99, end);
+    roundTripP99->setValue(*p99 / 1e9);
+}
+
+void Script::updateProcessStats()
+{
+    auto pid = transport->processId();
+    if (!pid)
+        return;
+
+    // Limits applied to the process, they don't change while it runs but the scope of systemd-run is created after start
+    if (niceLevel->isSubscribed() || ioPriority->isSubscribed() || cpuAffinity->isSubscribed() || memoryMax->isSubscribed() || cpuQuota->isSubscribed())
+    {
+        auto limits = ProcessLimits::fromProcess(pid);
+        niceLevel->setValue(limits.nice ? QVariant(*limits.nice) : QVariant());
+        ioPriority->setValue(limits.ioPriorityName());
+        cpuAffinity->setValue(limits.cpuList());
+        memoryMax->setValue(limits.memoryMax.isEmpty() ? QVariant() : QVariant(limits.memoryMax.toLongLong()));
+        cpuQuota->setValue(limits.cpuQuota.isEmpty() ? QVariant() : QVariant(limits.cpuQuota.chopped(1).toDouble()));
+    }
+
+    if (!memory->isSubscribed() && !cpuUsage->isSubscribed())
+        return;
+
+    QFile statm(QString("/proc/%1/statm").arg(pid));
+    if (statm.open(QIODevice::ReadOnly))
+        memory->setValue(statm.readAll().split(' ').value(1).toLongLong() * sysconf(_SC_PAGESIZE));
+
+    QFile stat(QString("/proc/%1/stat").arg(pid));
+    if (!stat.open(QIODevice::ReadOnly))
+        return;
+    auto fields = stat.readAll();
+    fields = fields.mid(fields.lastIndexOf(')') + 2); // Process name may contain spaces
+    auto values = fields.split(' ');
+    auto ticks = values.value(11).toLongLong() + values.value(12).toLongLong(); // User and system time
+    auto now = statsClock.nsecsElapsed();
+    if (pid == cpuPid && now > cpuSampleTime)
+        cpuUsage->setValue(100.0 * (ticks - cpuTicks) / sysconf(_SC_CLK_TCK) / ((now - cpuSampleTime) / 1e9));
+    cpuPid = pid; cpuTicks = ticks; cpuSampleTime = now;
+}
+
+
+QVariant AverageSensor::value() const
+{
+    auto total = AggregateSensor::value();
+    if (total.userType() != QMetaType::QPointF) // Not folded, a single sensor or none had a value
+        return total.isValid() ? QVariant(total.toDouble()) : QVariant();
+    auto sum = total.toPointF();
+    return sum.y() > 0 ? QVariant(sum.x() / sum.y()) : QVariant();
+}
+
+QVariant AverageSensor::accumulate(const QVariant &total, const QVariant &value)
+{
+    // The fold starts with the value of the first sensor, its results hold the sum and count of valid values as x and y
+    auto sum = total.userType() == QMetaType::QPointF ? total.toPointF() : total.isValid() ? QPointF(total.toDouble(), 1) : QPointF();
+    if (value.isValid())
+        sum += QPointF(value.toDouble(), 1);
+    return sum;
+}
+
+
+HistoryProperty::HistoryProperty(const QString &id, const QString &name, const QElapsedTimer &clock, KSysGuard::SensorObject *parent) : KSysGuard::SensorProperty(id, name, parent), clock(clock)
+{
+    setDescription(i18nc("@info", "JSON object of recent values, \"1\" being [time, value] pairs of every sample and other keys [time, min, max, avg] of that many samples, oldest first, with times in milliseconds since epoch"));
+    setVariantType(QVariant::String);
+}
+
+void HistoryProperty::add(qint64 time, double value)
+{
+    append(0, time, value, value, value);
+}
+
+void HistoryProperty::append(int level, qint64 time, double min, double max, double avg)
+{
+    auto &samples = history[level];
+    samples.times[samples.next] = time;
+    samples.min[samples.next] = min;
+    samples.max[samples.next] = max;
+    samples.avg[samples.next] = avg;
+    samples.next = (samples.next + 1) % capacity;
+    samples.count = qMin(samples.count + 1, capacity);
+
+    if (level + 1 == levels)
+        return;
+    auto &bucket = history[level + 1];
+    if (!bucket.bucketCount)
+    {
+        bucket.bucketTime = time;
+        bucket.bucketMin = min;
+        bucket.bucketMax = max;
+        bucket.bucketSum = 0;
+    }
+    bucket.bucketMin = qMin(bucket.bucketMin, min);
+    bucket.bucketMax = qMax(bucket.bucketMax, max);
+    bucket.bucketSum += avg;
+    if (++bucket.bucketCount == factor)
+    {
+        bucket.bucketCount = 0;
+        append(level + 1, bucket.bucketTime, bucket.bucketMin, bucket.bucketMax, bucket.bucketSum / factor);
+    }
+}
+
+QVariant HistoryProperty::value() const
+{
+    // Convert monotonic times of samples to wall clock at the time of the request
+    auto now = QDateTime::currentMSecsSinceEpoch();
+    auto elapsed = clock.nsecsElapsed();
+
+    QJsonObject levelsObject;
+    for (int level = 0, samplesPerEntry = 1; level < levels; level++, samplesPerEntry *= factor)
+    {
+        const auto &samples = history[level];
+        QJsonArray entries;
+        for (int i = 0; i < samples.count; i++)
+        {
+            auto index = (samples.next - samples.count + i + capacity) % capacity;
+            auto time = now - (elapsed - samples.times[index]) / 1000000;
+            if (level == 0)
+                entries.append(QJsonArray{ time, samples.avg[index] });
+            else
+                entries.append(QJsonArray{ time, samples.min[index], samples.max[index], samples.avg[index] });
+        }
+        levelsObject.insert(QString::number(samplesPerEntry), entries);
+    }
+    return QString::fromUtf8(QJsonDocument(levelsObject).toJson(QJsonDocument::Compact));
+}
+
+
+static std::string_view trimmed(std::string_view text)
+{
+    while (!text.empty() && std::isspace(uchar(text.front())))
+        text.remove_prefix(1);
+    while (!text.empty() && std::isspace(uchar(text.back())))
+        text.remove_suffix(1);
+    return text;
+}
+
+template<typename T>
+static bool parseNumber(std::string_view text, T &number)
+{
+    if (!text.empty() && text.front() == '+') // Not accepted by from_chars
+        text.remove_prefix(1);
+    auto end = text.data() + text.size();
+    auto result = std::from_chars(text.data(), end, number);
+    return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
+
+void ScriptSensor::setValueType(QVariant::Type type)
+{
+    if (isCounter())
+        type = QVariant::Double;
+    variantType = type;
+    hasLastValue = false;
+    switch (type)
+    {
+        case QVariant::Double: parser = Parser::Double; break;
+        case QVariant::Int: case QVariant::LongLong: parser = Parser::Int; break;
+        case QVariant::UInt: case QVariant::ULongLong: parser = Parser::UInt; break;
+        case QVariant::Bool: parser = Parser::Bool; break;
+        default: parser = Parser::Other; break;
+    }
+}
+
+void ScriptSensor::setCounter(bool counter)
+{
+    if (counter == isCounter())
+        return;
+    lastCountTime = counter ? noSample : noCount;
+    hasLastValue = false;
+}
+
+bool ScriptSensor::updateValue(std::string_view text, bool &ok, qint64 time)
+{
+    auto changed = setText(text, ok, time);
+    recordHistory(time);
+    return changed;
+}
+
+bool ScriptSensor::updateValue(double number, qint64 time)
+{
+    auto changed = setDouble(number, time);
+    recordHistory(time);
+    return changed;
+}
+
+bool ScriptSensor::setText(std::string_view text, bool &ok, qint64 time)
+{
+    text = trimmed(text);
+    ok = true;
+    if (isCounter())
+    {
+        double count = 0;
+        if (!(ok = parseNumber(text, count)))
+        {
+            lastCountTime = noSample; // Don't compute rate over the missed sample
+            return false;
+        }
+        return updateCount(count, time);
+    }
+    switch (parser)
+    {
+        case Parser::Double:
+        {
+            double number = 0;
+            if (!(ok = parseNumber(text, number)))
+                number = 0;
+            return setNumber(number);
+        }
+        case Parser::Int:
+        {
+            qint64 number = 0;
+            if (!(ok = parseNumber(text, number)))
+                number = 0;
+            return setNumber(number);
+        }
+        case Parser::UInt:
+        {
+            quint64 number = 0;
+            if (!(ok = parseNumber(text, number)))
+                number = 0;
+            return setNumber(number);
+        }
+        case Parser::Bool: // Same rules as QVariant string to bool conversion
+            return setNumber(qint64(!(text.empty() || text == "0" || QByteArray(text.data(), text.size()).toLower() == "false")));
+        case Parser::Other:
+        {
+            QVariant value(QString::fromLocal8Bit(text.data(), text.size()));
+            ok = value.convert(variantType);
+            if (hasLastValue && value == (pending ? pendingValue : this->value()))
+                return false;
+            hasLastValue = true;
+            setPendingValue(value);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ScriptSensor::setDouble(double number, qint64 time)
+{
+    if (isCounter())
+        return updateCount(number, time);
+    switch (parser)
+    {
+        case Parser::Double: return setNumber(number);
+        case Parser::Int: case Parser::Bool: return setNumber(qint64(number));
+        case Parser::UInt: return setNumber(quint64(qMax(number, 0.0)));
+        case Parser::Other: break;
+    }
+    return false;
+}
+
+bool ScriptSensor::updateCount(double count, qint64 time)
+{
+    auto previousCount = std::exchange(lastCount, count);
+    auto previousTime = std::exchange(lastCountTime, time);
+    if (previousTime == noSample || count < previousCount || time <= previousTime) // No previous sample or counter was reset
+        return false;
+    return setNumber((count - previousCount) * 1e9 / (time - previousTime)); // Per second
+}
+
+bool ScriptSensor::setNumber(double number)
+{
+    if (hasLastValue && lastDouble == number)
+        return false;
+    hasLastValue = true;
+    lastDouble = number;
+    setPendingValue(number);
+    return true;
+}
+
+bool ScriptSensor::setNumber(qint64 number)
+{
+    if (hasLastValue && lastInt == number)
+        return false;
+    hasLastValue = true;
+    lastInt = number;
+    if (variantType == QVariant::Bool)
+        setPendingValue(bool(number));
+    else if (variantType == QVariant::Int)
+        setPendingValue(int(number));
+    else
+        setPendingValue(qlonglong(number));
+    return true;
+}
+
+bool ScriptSensor::setNumber(quint64 number)
+{
+    if (hasLastValue && lastUInt == number)
+        return false;
+    hasLastValue = true;
+    lastUInt = number;
+    if (variantType == QVariant::UInt)
+        setPendingValue(uint(number));
+    else
+        setPendingValue(qulonglong(number));
+    return true;
+}
+
+void ScriptSensor::recordHistory(qint64 time)
+{
+    if (!history || !hasLastValue)
+        return;
+    switch (parser)
+    {
+        case Parser::Double: history->add(time, lastDouble); break;
+        case Parser::Int: case Parser::Bool: history->add(time, lastInt); break;
+        case Parser::UInt: history->add(time, lastUInt); break;
+        case Parser::Other: break;
+    }
+}
+
+void ScriptSensor::clearValue()
+{
+    hasLastValue = false;
+    setPendingValue(QVariant());
+}
+
+void ScriptSensor::setPendingValue(const QVariant &value)
+{
+    pendingValue = value;
+    pending = true;
+}
+
+void ScriptSensor::publish()
+{
+    if (!pending)
+        return;
+    pending = false;
+    if (pendingValue != this->value()) // Changed back within the update
+        setValue(pendingValue);
+}
+
+
+ScriptFile ScriptFile::fromPath(const QString &path)
+{
+    struct stat buffer;
+    if (stat(QFile::encodeName(path).constData(), &buffer) != 0)
+        return {};
+    return { qint64(buffer.st_mtim.tv_sec) * 1000000000 + buffer.st_mtim.tv_nsec, qint64(buffer.st_size), quint64(buffer.st_ino) };
+}
+
+QDataStream &operator<<(QDataStream &stream, const ScriptFile &file)
+{
+    return stream << file.modified << file.size << file.inode;
+}
+
+QDataStream &operator>>(QDataStream &stream, ScriptFile &file)
+{
+    return stream >> file.modified >> file.size >> file.inode;
+}
+
+QDataStream &operator<<(QDataStream &stream, const ScriptSchema &schema)
+{
+    return stream << schema.file << schema.subscribed << schema.sensors;
+}
+
+QDataStream &operator>>(QDataStream &stream, ScriptSchema &schema)
+{
+    return stream >> schema.file >> schema.subscribed >> schema.sensors;
+}
+
+
+void *Task::promise_type::allocate(std::size_t size, Script &script)
+{
+    return script.framePool.allocate(size);
+}
+
+void Task::cancel()
+{
+    if (handle)
+        std::exchange(handle, nullptr).destroy();
+}
+
+std::exception_ptr Task::finish()
+{
+    auto exception = handle.promise().exception;
+    cancel();
+    return exception;
+}
+
+
+void ValueSnapshot::reset(qsizetype size)
+{
+    for (auto buffer : { &pending, &committed })
+    {
+        buffer->clear();
+        buffer->resize(size);
+    }
+    fresh = false;
+}
+
+void ValueSnapshot::begin()
+{
+    for (auto& value : pending)
+        value.received = false;
+}
+
+void ValueSnapshot::setText(qsizetype index, std::string_view text, qint64 time)
+{
+    auto& value = pending[index];
+    value.received = true;
+    value.numeric = false;
+    value.text.resize(text.size()); // Keeps capacity of the previous cycle
+    memcpy(value.text.data(), text.data(), text.size());
+    value.time = time;
+}
+
+void ValueSnapshot::setNumber(qsizetype index, double number, qint64 time)
+{
+    auto& value = pending[index];
+    value.received = true;
+    value.numeric = true;
+    value.number = number;
+    value.time = time;
+}
+
+void ValueSnapshot::commit()
+{
+    pending.swap(committed); // Values of the previous snapshot are overwritten by the next cycle
+    fresh = true;
+}
+
+const QVector<ValueSnapshot::Value> *ValueSnapshot::take()
+{
+    if (!fresh)
+        return nullptr;
+    fresh = false;
+    return &committed;
+}
+
+
+FramePool::~FramePool()
+{
+    while (freeFrames)
+        ::operator delete(std::exchange(freeFrames, freeFrames->next));
+}
+
+void *FramePool::allocate(std::size_t size)
+{
+    // Coroutines of a script are of a few sizes, so any free frame that fits is taken
+    for (auto frame = &freeFrames; *frame; frame = &(*frame)->next)
+        if ((*frame)->size >= size)
+        {
+            auto header = std::exchange(*frame, (*frame)->next);
+            freeCount--;
+            return header + 1;
+        }
+
+    auto header = static_cast<Header*>(::operator new(sizeof(Header) + size));
+    header->pool = this;
+    header->size = size;
+    return header + 1;
+}
+
+void FramePool::deallocate(void *frame)
+{
+    auto header = static_cast<Header*>(frame) - 1;
+    auto pool = header->pool;
+    if (pool->freeCount >= maxFreeFrames)
+    {
+        ::operator delete(header);
+        return;
+    }
+    header->next = std::exchange(pool->freeFrames, header);
+    pool->freeCount++;
+}
+
+
+Request* Request::request(QString request0, QString request1)
+{
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << script->id() << "Requested:" << request0 + (request1 == "" ? QString("") : "\t" + request1);
+    auto data = (request0 + (request1 == "" ? QString("") : "\t" + request1) + "\n").toLocal8Bit();
+    script->transport->device().write(data);
+    script->requestsWritten(1);
+    tickets.enqueue(script->expectReply(script->sensorIndex(request0), data.size()));
+    return this;
+}
+
+Request* Request::requestAll(const QList<QPair<QString, QString>> &requests)
+{
+    if (requests.isEmpty())
+        return this;
+
+    QByteArray data;
+    for (const auto& request : requests)
+    {
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << script->id() << "Requested:" << request.first + (request.second == "" ? QString("") : "\t" + request.second);
+        auto size = data.size();
+        data += (request.first + (request.second == "" ? QString("") : "\t" + request.second) + "\n").toLocal8Bit();
+        tickets.enqueue(script->expectReply(script->sensorIndex(request.first), data.size() - size));
+    }
+    script->transport->device().write(data);
+    script->requestsWritten(requests.size());
+    return this;
+}
+
+Request* Request::next()
+{
+    return this;
+}
+
+RawReply Request::raw()
+{
+    return { this };
+}
+
+bool RawReply::await_ready() noexcept
+{
+    return r->script->replyAvailable(r->tickets.head(), size);
+}
+
+void RawReply::await_suspend(std::coroutine_handle<> h)
+{
+    r->script->awaitReply(r->tickets.head(), size, h);
+}
+
+std::string_view RawReply::await_resume() noexcept
+{
+    auto line = size ? r->script->scriptOutput.take(size) : r->script->scriptOutput.takeLine();
+    r->tickets.dequeue();
+    r->script->replyTaken(line.size());
+    r->script->replyReceived();
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << r->script->id()  << "Received: " << QByteArray(line.data(), line.size());
+    return line;
+}
+
+Request* Request::requestBinary(const QByteArray &data)
+{
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << script->id() << "Requested:" << data.size() << "bytes";
+    script->transport->device().write(data);
+    script->requestsWritten(1);
+    tickets.enqueue(script->expectReply(-1, data.size()));
+    return this;
+}
+
+RawReply Request::binary(qsizetype size)
+{
+    return { this, size };
+}
+
+bool Request::await_ready() noexcept
+{
+    return script->replyAvailable(tickets.head(), 0); // Reply already received, no need to suspend
+}
+
+void Request::await_suspend(std::coroutine_handle<> h)
+{
+    script->awaitReply(tickets.head(), 0, h);
+}
+
+QString Request::await_resume() noexcept
+{
+    auto line = script->scriptOutput.takeLine();
+    tickets.dequeue();
+    script->replyTaken(line.size());
+    script->replyReceived();
+    auto reply = QString::fromLocal8Bit(line.data(), line.size()).trimmed();
+    qCDebug(KSYSTEMSTATS_SCRIPTS) << "Script:" << script->id()  << "Received: " << reply;
+    return reply;
+}
+
 
 #include "scripts.moc"
@@ -15,23 +15,66 @@
 #include <systemstats/SensorObject.h>
 #include <systemstats/SensorProperty.h>
 
+#include <array>
 #include <coroutine>
+#include <limits>
+#include <cstddef>
+#include <exception>
+#include <string_view>
+#include <utility>
 
-#include <QProcess>
 #include <QDir>
 #include <QFileSystemWatcher>
 #include <QDirIterator>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QDataStream>
+#include <QStandardPaths>
+#include <QFile>
+#include <QSet>
+#include <QQueue>
+#include <QRegularExpression>
+#include <QSettings>
+
+#include "transport.h"
 
 
 class Script;
 
 
+// Identifies a version of a script file, to restart only modified scripts
+struct ScriptFile
+{
+    qint64 modified = 0; // Nanoseconds since epoch
+    qint64 size = 0;
+    quint64 inode = 0;
+
+    static ScriptFile fromPath(const QString &path);
+    bool operator==(const ScriptFile &other) const = default;
+};
+
+
+// Sensors and their parameters reported by a script, cached to register sensors before the script replies
+struct ScriptSchema
+{
+    ScriptFile file; // Version of the script file this schema was reported by
+    bool subscribed = false; // Some sensor was in use when the schema was saved
+    QList<QPair<QString, QMap<QString, QString>>> sensors;
+};
+
+QDataStream &operator<<(QDataStream &stream, const ScriptFile &file);
+QDataStream &operator>>(QDataStream &stream, ScriptFile &file);
+QDataStream &operator<<(QDataStream &stream, const ScriptSchema &schema);
+QDataStream &operator>>(QDataStream &stream, ScriptSchema &schema);
+
+
 class ScriptsPlugin : public KSysGuard::SensorPlugin
 {
     Q_OBJECT
 
 public:
     ScriptsPlugin(QObject *parent, const QVariantList &args);
+    ~ScriptsPlugin();
 
     const QString scriptDirPath = QDir::homePath() + "/.local/share/ksystemstats-scripts";
 
@@ -42,16 +85,273 @@ private:
     KSysGuard::SensorContainer *container;
     QHash<QString, Script*> scripts;
     QFileSystemWatcher scriptDirWatcher;
+    QElapsedTimer updateClock; // Monotonic time for scheduling script updates
+    qint64 lastUpdate = 0;
+    QTimer watchdogTimer;
+    static constexpr int watchdogInterval = 1000;
+
+    QThread ioThread; // Transports of all scripts run here
+    QHash<QString, MuxConnection*> connections; // Socket path to connection shared by scripts in groups
+
+    const QString configPath = QStandardPaths::writableLocation(QStandardPaths::GenericConfigLocation) + "/ksystemstats-scriptsrc";
+    bool hostMode = false; // Run Python scripts in a single shared host process
+    bool historyEnabled = false; // Keep recent values of numeric sensors
+    MuxConnection *hostConnection = nullptr;
+
+    // Sensors computed from sensors of scripts, declared in config
+    struct Aggregate
+    {
+        KSysGuard::AggregateSensor *sensor;
+        QRegularExpression objects; // Matched script ids
+        QString property; // Matched sensor id
+    };
+    KSysGuard::SensorObject *aggregates = nullptr;
+    QList<Aggregate> aggregateSensors;
+
+    void loadAggregates(QSettings &config);
+    void refreshAggregates(); // Match sensors created since the last refresh
+
+    QList<Script*> startQueue; // Scripts waiting for a free start slot
+    QSet<Script*> startingScripts; // Started scripts that didn't finish init yet
+    int maxStartingScripts = 4; // 0 to start all scripts at once
+
+    void queueStart(Script *script);
+    void startQueued();
+    void startFinished(Script *script);
 
     void initScripts();
     void deinitScripts();
+    void addScript(const QString &scriptAbsPath, const QString &scriptRelPath);
+    void removeScript(const QString &scriptRelPath);
+    ScriptTransport *createTransport(const QString &scriptAbsPath);
+    static bool isHostedScript(const QString &scriptAbsPath);
+    bool usesHost(const QString &scriptAbsPath) const;
+
+    QHash<QString, ScriptSchema> schemaCache; // Relative script path to its last reported schema
+    QTimer schemaSaveTimer; // Collects schemas of scripts initialized at about the same time into one write
+    const QString schemaCachePath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/ksystemstats-scripts/schema";
+    static constexpr quint32 schemaCacheVersion = 2;
+
+    void loadSchemaCache();
+    void saveSchemaCache();
+
+    // Recent request and reply events are written out when the trigger file is created
+    const QString traceTriggerPath = scriptDirPath + "/.dump-trace";
+    const QString traceDumpPath = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + "/ksystemstats-scripts/trace";
+
+    void dumpTrace();
 
 private slots:
     void directoryChanged(const QString& path);
 };
 
 
-struct Coroutine;
+// Average of matched sensors, AggregateSensor only folds values pairwise
+class AverageSensor : public KSysGuard::AggregateSensor
+{
+public:
+    using KSysGuard::AggregateSensor::AggregateSensor;
+
+    QVariant value() const override;
+    static QVariant accumulate(const QVariant &total, const QVariant &value); // Aggregate function, sums and counts valid values
+};
+
+
+// Recent samples of a sensor, raw and decimated into min/max/avg buckets, with all storage allocated up front
+class HistoryProperty : public KSysGuard::SensorProperty
+{
+public:
+    HistoryProperty(const QString &id, const QString &name, const QElapsedTimer &clock, KSysGuard::SensorObject *parent);
+
+    void add(qint64 time, double value); // Time in nanoseconds of clock
+    QVariant value() const override; // Serialized on request only, so recording doesn't notify clients
+
+    static constexpr int capacity = 256; // Samples kept per level
+    static constexpr int factor = 16; // Samples of a level combined into one of the next level
+    static constexpr int levels = 3;
+
+private:
+    struct Level
+    {
+        std::array<qint64, capacity> times;
+        std::array<double, capacity> min, max, avg; // All equal on the raw level
+        int count = 0;
+        int next = 0; // Oldest sample once the level is full
+
+        // Bucket being filled from the level below
+        qint64 bucketTime = 0;
+        double bucketMin = 0, bucketMax = 0, bucketSum = 0;
+        int bucketCount = 0;
+    };
+
+    std::array<Level, levels> history;
+    const QElapsedTimer &clock;
+
+    void append(int level, qint64 time, double min, double max, double avg);
+};
+
+
+// Sensor provided by a script, with its own update schedule
+class ScriptSensor : public KSysGuard::SensorProperty
+{
+public:
+    using KSysGuard::SensorProperty::SensorProperty;
+
+    void setValueType(QVariant::Type type); // Counters are always reported as double rates
+    QVariant::Type valueType() const { return variantType; }
+    bool isNumeric() const { return parser != Parser::Other; }
+    void setCounter(bool counter);
+    bool isCounter() const { return lastCountTime != noCount; }
+    // Returns true if value changed, on failed conversion value is zero (counters keep the last rate), time of arrival is used by counters only
+    bool updateValue(std::string_view text, bool &ok, qint64 time);
+    bool updateValue(double number, qint64 time); // Numeric sensors only
+    void clearValue();
+    void publish(); // New values are only set by this, so changes are notified once per update
+
+    QString reportedId; // Name of the sensor in requests to the script, id() differs if it was taken by a built-in sensor
+    HistoryProperty *history = nullptr; // Recent values, if history is enabled and the sensor is numeric
+    bool active = true; // Reported by script in its current run
+    int index = -1; // Position in the sensors of the script, valid while active
+    bool due = false; // Value is requested in the current update
+    qint64 interval = 0; // Milliseconds between value requests, 0 to use script interval
+    qint64 nextUpdate = 0;
+
+private:
+    enum class Parser { Double, Int, UInt, Bool, Other };
+
+    QVariant::Type variantType = QVariant::String;
+    Parser parser = Parser::Other;
+    bool hasLastValue = false;
+    QVariant pendingValue; // Value not published yet
+    bool pending = false;
+    union { double lastDouble; qint64 lastInt; quint64 lastUInt; }; // Last value set by a numeric parser
+
+    // Last sample of a counter, kept across restarts of the script so the rate continues
+    static constexpr qint64 noCount = std::numeric_limits<qint64>::min(); // Sensor is a gauge
+    static constexpr qint64 noSample = -1;
+    double lastCount = 0;
+    qint64 lastCountTime = noCount; // Monotonic nanoseconds
+
+    void setPendingValue(const QVariant &value);
+    bool setText(std::string_view text, bool &ok, qint64 time);
+    bool setDouble(double number, qint64 time);
+    bool updateCount(double count, qint64 time);
+    void recordHistory(qint64 time);
+    bool setNumber(double number);
+    bool setNumber(qint64 number);
+    bool setNumber(quint64 number);
+};
+
+
+// Header of a memory-mapped file shared by a script, followed by native-endian double values of all sensors
+struct SharedPage
+{
+    static constexpr quint32 Magic = 0x5053534b; // "KSSP"
+
+    quint32 magic;
+    quint32 count; // Number of values
+    quint32 sequence; // Incremented before and after the values are written, odd while writing
+    quint32 reserved;
+};
+
+
+// Values received in update cycles, indexed like the sensors of a script and handed over to the publishing side as
+// complete snapshots only. Both sides are on the main thread, commit swaps the pending values with the committed ones.
+class ValueSnapshot
+{
+public:
+    struct Value
+    {
+        bool received = false; // Set in this cycle
+        bool numeric = false; // Number instead of text was received
+        double number = 0;
+        QByteArray text; // Storage is reused between cycles
+        qint64 time = 0; // Arrival time, in nanoseconds of the script stats clock
+    };
+
+    void reset(qsizetype size); // Drops all values, neither side may use the snapshot meanwhile
+
+    // Writing side
+    void begin(); // Starts a new cycle, dropping values of one that wasn't committed
+    void setText(qsizetype index, std::string_view text, qint64 time);
+    void setNumber(qsizetype index, double number, qint64 time);
+    void commit(); // Replaces a snapshot that wasn't taken yet
+
+    // Publishing side
+    const QVector<Value> *take(); // Newest committed snapshot or null if none since last take, valid until next commit
+
+private:
+    QVector<Value> pending; // Written in the current cycle
+    QVector<Value> committed; // Taken by the publishing side, then reused for a later cycle
+    bool fresh = false; // Committed since last take
+};
+
+
+// Reuses memory of finished coroutine frames, so starting an update doesn't allocate
+class FramePool
+{
+public:
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    ~FramePool(); // All frames must be deallocated by now
+
+    void *allocate(std::size_t size);
+    static void deallocate(void *frame); // Returns frame to the pool it was allocated from
+
+private:
+    struct alignas(std::max_align_t) Header
+    {
+        FramePool *pool;
+        std::size_t size;
+        Header *next; // Next free frame
+    };
+
+    Header *freeFrames = nullptr;
+    int freeCount = 0;
+    static constexpr int maxFreeFrames = 4;
+};
+
+
+// Coroutine owned by the task, started explicitly, destroying or cancelling the task destroys the coroutine at its co_await
+class Task
+{
+public:
+    struct promise_type
+    {
+        std::exception_ptr exception;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; } // Kept until the owner collects the result
+        void return_void() { }
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        // Frames of Script member coroutines are allocated from its pool
+        template<typename... Args>
+        static void *operator new(std::size_t size, Script &script, const Args&...) { return allocate(size, script); }
+        static void operator delete(void *frame, std::size_t) { FramePool::deallocate(frame); }
+        static void *allocate(std::size_t size, Script &script);
+    };
+
+    Task() = default;
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task &operator=(Task &&other) noexcept { cancel(); handle = std::exchange(other.handle, nullptr); return *this; }
+    ~Task() { cancel(); }
+
+    void start() { handle.resume(); }
+    bool isRunning() const { return handle && !handle.done(); }
+    bool isFinished() const { return handle && handle.done(); }
+    void cancel(); // Destroys the coroutine, which must be suspended
+    std::exception_ptr finish(); // Destroys the finished coroutine, returns the exception it exited with
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+struct RawReply;
 struct Request;
 
 class Script : public KSysGuard::SensorObject
@@ -59,53 +359,181 @@ class Script : public KSysGuard::SensorObject
     Q_OBJECT
 
     friend Request;
+    friend RawReply;
+    friend Task::promise_type;
 
 public:
-    Script(const QString &scriptPath, const QString &scriptRelPath, const QString &scriptName, KSysGuard::SensorContainer *parent);
+    Script(const QString &scriptPath, const QString &scriptRelPath, const QString &scriptName, ScriptTransport *transport, KSysGuard::SensorContainer *parent);
     ~Script();
 
-    void update();
+    bool isDue(qint64 now) const;
+    void update(qint64 now);
+    void publishValues(); // Apply values of the last complete update
+    void publishChanges(); // Notify clients of values changed since the last call
+    void start();
     void restart();
+    void checkTimeout();
+    void updateProcessStats(); // Sample memory and CPU usage of script process if they are in use
+    void setUpdatePeriod(qint64 period) { updatePeriod = period; }
+    void setHistoryEnabled(bool enabled) { historyEnabled = enabled; } // Applies to sensors created later
+    bool fileChanged() const; // Script or its limits file
+    bool isHosted() const { return transport->isMultiplexed() && !scriptPath.endsWith(".socket"); }
+    const ScriptSchema &schema() const { return sensorSchema; }
+    void loadSchema(const ScriptSchema &schema);
+    bool isSubscribed() const; // Some sensor is in use
+    bool wasSubscribed() const { return everSubscribed; } // Some sensor was in use since the plugin started
+    const quint32 traceId; // Identifies the script in trace records
+
+signals:
+    void initialized(); // Script replied to all init requests
+    void failed(); // Script stopped or didn't reply and will be restarted
+    void firstSubscribed(); // Some sensor was subscribed for the first time
+    void sensorsChanged(); // Sensors were added or removed without restarting script
 
 private:
-    QProcess scriptProcess;
-    QList<KSysGuard::SensorProperty*> sensors;
+    ScriptTransport *transport;
+    QList<ScriptSensor*> sensors;
+    QHash<QString, ScriptSensor*> sensorById;
     QString scriptPath;
+    ScriptFile scriptFile;
+    ScriptFile limitsFile; // Version of the limits file next to the script, if any
+    ScriptSchema sensorSchema;
+    bool ready = false; // Init finished, sensors can be updated
+    bool everSubscribed = false;
+    bool historyEnabled = false;
+    KSysGuard::SensorProperty *readyTime;
+    QElapsedTimer readyTimer; // Time since the script was queued or restarted, invalid once ready
+
+    bool stopping = false; // Transport is being stopped on purpose
+
+    QElapsedTimer replyTimer; // Time since last request or reply
+    QTimer restartTimer;
+    qint64 restartDelay = initialRestartDelay;
+    static constexpr qint64 requestTimeout = 10000;
+    static constexpr qint64 initialRestartDelay = 1000;
+    static constexpr qint64 maxRestartDelay = 300000;
 
-    QString scriptReply;
+    void stop();
+    void scheduleRestart(); // Restart failed script with increasing delay
 
-    Coroutine initSensors(std::coroutine_handle<> *h);
-    Coroutine updateSensors(std::coroutine_handle<> *h);
-    std::coroutine_handle<> initSensorsH, updateSensorsH;
-    bool initSensorAct = false, updateSensorsAct = false;
+    // Built-in sensors reporting the cost of the script
+    KSysGuard::SensorProperty *updateLatency, *roundTripMedian, *roundTripP99, *requestsPerUpdate;
+    KSysGuard::SensorProperty *conversionFailures, *restarts, *memory, *cpuUsage;
+    KSysGuard::SensorProperty *niceLevel, *ioPriority, *cpuAffinity, *memoryMax, *cpuQuota; // Applied process limits
+    QElapsedTimer statsClock; // Monotonic time for measuring requests
+    QQueue<qint64> requestTimes; // Write times of requests not replied to yet
+    std::array<qint64, 128> roundTrips; // Last round trip times in nanoseconds, oldest overwritten first
+    qsizetype roundTripCount = 0;
+    int updateRequests = 0; // Requests written in the current update
+    int conversionFailureCount = 0;
+    int restartCount = 0;
+    qint64 cpuPid = 0, cpuTicks = 0, cpuSampleTime = 0; // Last CPU usage sample
+
+    void requestsWritten(int count);
+    void replyReceived();
+    void publishRoundTrips();
+
+    LineBuffer scriptOutput;
+
+    // Reply expected for a written request, replies arrive in the order requests were written
+    struct Ticket
+    {
+        std::coroutine_handle<> waiter; // Coroutine suspended until the reply arrives, null if not awaited yet
+        qsizetype size = 0; // Size of awaited binary reply, 0 for a line
+        qint32 sensor = -1; // Index of the sensor the request is about, for tracing
+    };
+    QQueue<Ticket> pendingReplies;
+    quint64 firstTicket = 0; // Number of the oldest pending reply
+    quint64 nextTicket = 0;
+
+    quint64 expectReply(qint32 sensor, qsizetype bytes); // Sensor index and size of the written request
+    bool replyAvailable(quint64 ticket, qsizetype size);
+    void awaitReply(quint64 ticket, qsizetype size, std::coroutine_handle<> waiter);
+    void replyTaken(qsizetype bytes);
+    qint32 sensorIndex(const QString &sensorId) const; // -1 if not an active sensor
+    void indexSensors(); // After sensors list changed
+    void resumeWaiting(); // Resume coroutines whose replies arrived, collect finished ones
+    void finishTask(Task &task);
+    bool batchValues = false; // Script supports "*\tvalue" command
+    bool notifySubscriptions = false; // Script supports "subscribe" and "unsubscribe" commands
+    bool pipelineRequests = false; // Script answers requests written at once in order
+    bool streamValues = false; // Script sends values on its own after init
+    bool streaming = false; // Streaming was started
+    bool compactValues = false; // Values are requested and received in binary
+    bool tickUpdates = false; // Script is told when an update starts
+    bool hashSensors = false; // Script reports a hash of its sensor set, checked periodically
+    QString sensorHash; // Hash of the sensors created last
+    bool rescanPending = false; // Hash changed, sensors are requested again on next update
+    qint64 nextHashCheck = 0;
+    static constexpr qint64 hashInterval = 5000;
+    QStringList capabilities; // Reported in init, kept for rescans
+    quint64 tickGeneration = 0; // Number of the last update told to script
+
+    QFile sharedFile;
+    const uchar *sharedPage = nullptr; // Values are read from here instead of requested
+    QVector<double> sharedValues; // Copy of values from the last consistent read
+    quint32 sharedSequence = 1;
+    static constexpr int sharedPageAttempts = 3; // Reads of a page being written before giving up until next update
+
+    bool mapSharedPage(const QString &path);
+    void readSharedPage();
+    qint64 replyTime = 0; // When the last output of script was received, in statsClock nanoseconds
+    QHash<QString, bool> subscriptionChanges; // Sensor id to subscription state not yet sent to script
+
+    qint64 interval = 0; // Milliseconds between updates, 0 to update on every plugin update
+    qint64 maxInterval = 0; // Upper limit for backing off when values don't change
+    qint64 backoff = 1; // Multiplier of update intervals
+    qint64 updatePeriod = 0; // Milliseconds between plugin updates, base of backing off without intervals
+    int unchangedUpdates = 0; // Updates in a row that didn't change any value
+    bool valuesChanged = false;
+    static constexpr int backoffUpdates = 3; // Unchanged updates before doubling the intervals
+
+    ScriptSensor *createSensor(const QString &sensorName, const QMap<QString, QString> &sensorParameters);
+    qint64 sensorInterval(const ScriptSensor *sensor) const;
+    void applyStreamedValue(std::string_view line);
+    void changeStreamedSensor(bool add, std::string_view line); // Rest of a "+" or "-" line
+    void setSensorValue(ScriptSensor *sensor, std::string_view valueStr, qint64 time);
+
+    ValueSnapshot snapshot; // Filled by updates, published by the plugin update, both on the main thread
+
+    FramePool framePool; // Outlives the tasks below
+    Task initSensors(bool rescan = false); // Rescan only queries sensors not known yet, keeping the rest
+    Task updateSensors(qint64 now);
+    Task initTask, updateTask;
 
 private slots:
-    void stateChanged(QProcess::ProcessState newState);
+    void transportStarted();
+    void transportStopped();
     void readyReadStandardOutput();
 };
 
 
+// Writes requests of a coroutine and awaits their replies in the order they were written
 struct Request
 {
-  std::coroutine_handle<> *hp;
   Script* script;
+  QQueue<quint64> tickets = {}; // Replies of this coroutine not awaited yet
+
   Request* request(QString request0, QString request1="");
+  Request* requestAll(const QList<QPair<QString, QString>> &requests); // Write several requests at once
+  Request* next(); // Await reply to an earlier written request
+  RawReply raw(); // Await reply as bytes instead of QString
+  Request* requestBinary(const QByteArray &data);
+  RawReply binary(qsizetype size); // Await binary reply of given size
 
-  constexpr bool await_ready() const noexcept { return false; }
-  void await_suspend(std::coroutine_handle<> h) { *hp = h; }
+  bool await_ready() noexcept;
+  void await_suspend(std::coroutine_handle<> h);
   QString await_resume() noexcept;
 };
 
-struct Coroutine
+struct RawReply
 {
-  struct promise_type
-  {
-    Coroutine get_return_object() { return {}; }
-    std::suspend_never initial_suspend() { return {}; }
-    std::suspend_never final_suspend() noexcept { return {}; }
-    void return_void() { }
-    void unhandled_exception() {}
-  };
+  Request *r;
+  qsizetype size = 0; // Binary reply size, 0 for a line
+
+  bool await_ready() noexcept;
+  void await_suspend(std::coroutine_handle<> h);
+  std::string_view await_resume() noexcept; // Valid until next reply is awaited
 };
 
 #endif
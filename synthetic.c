@@ -0,0 +1,111 @@
+// Synthetic script for measuring the plugin, reports sensors s0, s1, ... with values changing on every request.
+// The number of sensors and the advertised capabilities are taken from the file name, e.g. synthetic-100-value-pipeline.
+//
+// $ cc -O2 -o ~/.local/share/ksystemstats-scripts/synthetic-1000-compact synthetic.c
+
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t tick = 0;
+
+static double value(long sensor)
+{
+    return (double)((tick + sensor) % 1000) / 10;
+}
+
+static void compact(long count)
+{
+    // Binary requests of 2 byte sensor indices, replied to with 8 byte doubles once all indices available are read
+    static unsigned char request[65536], reply[sizeof(request) / 2 * 8];
+    size_t pending = 0;
+    ssize_t size;
+    while ((size = read(STDIN_FILENO, request + pending, sizeof(request) - pending)) > 0)
+    {
+        size_t available = pending + size, replySize = 0;
+        for (size_t offset = 0; offset + 2 <= available; offset += 2)
+        {
+            long sensor = request[offset] | request[offset + 1] << 8;
+            double number = sensor < count ? value(sensor) : 0;
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            for (int i = 0; i < 8; i++)
+                reply[replySize++] = bits >> (8 * i);
+            tick++;
+        }
+        pending = available % 2;
+        if (pending)
+            request[0] = request[available - 1];
+        for (size_t written = 0; written < replySize;)
+        {
+            ssize_t result = write(STDOUT_FILENO, reply + written, replySize - written);
+            if (result <= 0)
+                return;
+            written += result;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    char *name = basename(argv[0]);
+    char *capabilities = name + strlen(name); // Empty unless listed after the sensor count, rewritten in place below
+    char *dash = strchr(name, '-');
+    long count = dash ? strtol(dash + 1, &capabilities, 10) : 10;
+    if (*capabilities == '-')
+        capabilities++;
+    for (char *c = capabilities; *c; c++)
+        if (*c == '-')
+            *c = '\t';
+
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        char *sensor = line, *tab = strchr(line, '\t');
+        const char *command = "";
+        if (tab)
+        {
+            *tab = 0;
+            command = tab + 1;
+        }
+
+        if (!strcmp(sensor, "?"))
+        {
+            for (long i = 0; i < count; i++)
+                printf(i ? "\ts%ld" : "s%ld", i);
+            putchar('\n');
+        }
+        else if (!strcmp(sensor, "*") && !strcmp(command, "capabilities"))
+            puts(capabilities);
+        else if (!strcmp(sensor, "*") && !strcmp(command, "value"))
+        {
+            for (long i = 0; i < count; i++)
+                printf(i ? "\t%g" : "%g", value(i));
+            putchar('\n');
+            tick++;
+        }
+        else if (!strcmp(sensor, "*") && !strcmp(command, "compact"))
+        {
+            puts("");
+            fflush(stdout);
+            compact(count);
+            return 0;
+        }
+        else if (sensor[0] == 's' && !strcmp(command, "value"))
+        {
+            printf("%g\n", value(atol(sensor + 1)));
+            tick++;
+        }
+        else if (sensor[0] == 's' && !strcmp(command, "variant_type"))
+            puts("double");
+        else
+            puts("");
+        fflush(stdout);
+    }
+    return 0;
+}
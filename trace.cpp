@@ -0,0 +1,51 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#include "trace.h"
+#include "debug.h"
+#include <chrono>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+
+std::array<Trace::Record, Trace::capacity> Trace::records;
+std::atomic<quint64> Trace::next = 0;
+std::atomic<quint32> Trace::lastScriptId = 0;
+
+
+void Trace::record(Event event, quint32 script, quint32 ticket, qint32 sensor, quint32 bytes)
+{
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    records[next.fetch_add(1, std::memory_order_relaxed) & (capacity - 1)] = { time, script, ticket, sensor, bytes, event };
+}
+
+bool Trace::dump(const QString &path, const QHash<quint32, QString> &scripts)
+{
+    static const char *eventNames[] = { "request", "reply", "read", "started", "stopped", "update_started", "update_finished" };
+
+    QDir().mkpath(QFileInfo(path).path());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Can't write trace:" << path << file.errorString();
+        return false;
+    }
+
+    QByteArray text;
+    for (auto script = scripts.constBegin(); script != scripts.constEnd(); script++)
+        text += QByteArray("# ") + QByteArray::number(script.key()) + '\t' + script.value().toUtf8() + '\n';
+    text += "# time_ns\tscript\tevent\tticket\tsensor\tbytes\n";
+
+    auto end = next.load(std::memory_order_relaxed);
+    for (auto i = end > quint64(capacity) ? end - capacity : 0; i < end; i++)
+    {
+        const auto& record = records[i & (capacity - 1)];
+        text += QByteArray::number(record.time) + '\t' + QByteArray::number(record.script) + '\t' + eventNames[record.event] + '\t'
+            + QByteArray::number(record.ticket) + '\t' + QByteArray::number(record.sensor) + '\t' + QByteArray::number(record.bytes) + '\n';
+    }
+    file.write(text);
+    return file.commit();
+}
@@ -0,0 +1,45 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <array>
+#include <atomic>
+
+#include <QHash>
+#include <QString>
+
+
+// Fixed size ring of binary records of the request and reply path, always recorded and written out on demand
+class Trace
+{
+public:
+    enum Event : quint8 { Request, Reply, Read, Started, Stopped, UpdateStarted, UpdateFinished };
+
+    struct Record
+    {
+        qint64 time; // Monotonic nanoseconds
+        quint32 script; // Trace id of the script
+        quint32 ticket; // Low bits of the number of the request, matches a request to its reply
+        qint32 sensor; // Index in the reply to "?", -1 for commands not about a single sensor
+        quint32 bytes;
+        Event event;
+    };
+
+    static void record(Event event, quint32 script, quint32 ticket = 0, qint32 sensor = -1, quint32 bytes = 0);
+    static bool dump(const QString &path, const QHash<quint32, QString> &scripts); // Oldest record first, as text
+    static quint32 nextScriptId() { return ++lastScriptId; }
+
+    static constexpr int capacity = 8192; // Power of two
+
+private:
+    static std::array<Record, capacity> records;
+    static std::atomic<quint64> next; // Total records written, the ring is overwritten from the oldest
+    static std::atomic<quint32> lastScriptId;
+};
+
+#endif
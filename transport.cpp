@@ -0,0 +1,535 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#include "transport.h"
+#include "debug.h"
+#include <qdebug.h>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <QFile>
+#include <QSettings>
+#include <QTimer>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+qint64 ScriptTransport::monotonicTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void LineBuffer::readFrom(QIODevice &device)
+{
+    auto available = device.bytesAvailable();
+    if (available <= 0)
+        return;
+
+    if (begin == end) // Everything consumed, start from the beginning
+        begin = end = scanned = 0;
+    if (end + available > buffer.size())
+    {
+        // Move unconsumed data to the front, grow only if that's not enough
+        if (begin > 0)
+        {
+            memmove(buffer.data(), buffer.constData() + begin, end - begin);
+            end -= begin; scanned -= begin; begin = 0;
+        }
+        if (end + available > buffer.size())
+            buffer.resize(qMax<qsizetype>(buffer.size() * 2, end + available));
+    }
+
+    auto read = device.read(buffer.data() + end, available);
+    if (read > 0)
+        end += read;
+}
+
+bool LineBuffer::hasLine()
+{
+    if (scanned < end && buffer.at(scanned) == '\n')
+        return true;
+    auto newline = static_cast<const char*>(memchr(buffer.constData() + scanned, '\n', end - scanned));
+    scanned = newline ? newline - buffer.constData() : end;
+    return newline != nullptr;
+}
+
+std::string_view LineBuffer::takeLine()
+{
+    auto lineEnd = scanned;
+    if (lineEnd > begin && buffer.at(lineEnd - 1) == '\r') // Strip CRLF line endings
+        lineEnd--;
+    std::string_view line(buffer.constData() + begin, lineEnd - begin);
+    begin = scanned = scanned + 1;
+    return line;
+}
+
+std::string_view LineBuffer::take(qsizetype size)
+{
+    std::string_view data(buffer.constData() + begin, size);
+    begin += size;
+    scanned = qMax(scanned, begin);
+    return data;
+}
+
+void LineBuffer::clear()
+{
+    begin = end = scanned = 0;
+}
+
+
+RelayDevice::RelayDevice(std::function<void(const char *data, qint64 size)> writer, QObject *parent) : QIODevice(parent), writer(std::move(writer))
+{
+    open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+}
+
+qint64 RelayDevice::readData(char *data, qint64 maxSize)
+{
+    auto size = qMin<qint64>(maxSize, input.size());
+    memcpy(data, input.constData(), size);
+    input.remove(0, size);
+    return size;
+}
+
+qint64 RelayDevice::writeData(const char *data, qint64 size)
+{
+    writer(data, size);
+    return size;
+}
+
+
+static constexpr int ioprioWhoProcess = 1; // IOPRIO_WHO_PROCESS
+static constexpr int ioprioClassShift = 13;
+static const QStringList ioClassNames { "none", "realtime", "best-effort", "idle" }; // Indexed by IOPRIO_CLASS_*
+
+QString ProcessLimits::ioPriorityName() const
+{
+    if (ioClass <= 0 || ioClass >= ioClassNames.size())
+        return ioClassNames[0];
+    return ioClass == 3 ? ioClassNames[ioClass] : ioClassNames[ioClass] + " " + QString::number(ioPriority); // Idle has no levels
+}
+
+QString ProcessLimits::cpuList() const
+{
+    QStringList ranges;
+    for (int i = 0; i < cpus.size(); i++)
+    {
+        auto first = cpus[i];
+        while (i + 1 < cpus.size() && cpus[i + 1] == cpus[i] + 1)
+            i++;
+        ranges.append(first == cpus[i] ? QString::number(first) : QString("%1-%2").arg(first).arg(cpus[i]));
+    }
+    return ranges.join(',');
+}
+
+ProcessLimits ProcessLimits::fromFile(const QString &path)
+{
+    ProcessLimits limits;
+    if (!QFile::exists(path))
+        return limits;
+
+    QSettings file(path, QSettings::IniFormat);
+    if (file.contains("Limits/Nice"))
+        limits.nice = qBound(-20, file.value("Limits/Nice").toInt(), 19);
+    limits.ioClass = qMax(0, ioClassNames.indexOf(file.value("Limits/IoClass").toString()));
+    limits.ioPriority = qBound(0, file.value("Limits/IoPriority", limits.ioPriority).toInt(), 7);
+    for (const auto& range : file.value("Limits/CpuAffinity").toStringList()) // Like "0-3,6", split at commas by QSettings
+    {
+        auto bounds = range.split('-');
+        bool firstOk, lastOk = true;
+        auto first = bounds.value(0).trimmed().toInt(&firstOk);
+        auto last = first;
+        if (bounds.size() > 1)
+            last = bounds.value(1).trimmed().toInt(&lastOk);
+        if (!firstOk || !lastOk || first < 0 || last >= CPU_SETSIZE)
+        {
+            qCWarning(KSYSTEMSTATS_SCRIPTS) << "Limits:" << path << "Invalid CPU range:" << range;
+            continue;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            if (!limits.cpus.contains(cpu))
+                limits.cpus.append(cpu);
+    }
+    std::sort(limits.cpus.begin(), limits.cpus.end());
+    limits.memoryMax = file.value("Limits/MemoryMax").toString();
+    limits.cpuQuota = file.value("Limits/CpuQuota").toString();
+    return limits;
+}
+
+ProcessLimits ProcessLimits::fromProcess(qint64 pid)
+{
+    ProcessLimits limits;
+    errno = 0;
+    auto nice = getpriority(PRIO_PROCESS, pid);
+    if (errno == 0)
+        limits.nice = nice;
+
+    auto ioprio = syscall(SYS_ioprio_get, ioprioWhoProcess, pid);
+    if (ioprio >= 0)
+    {
+        limits.ioClass = ioprio >> ioprioClassShift;
+        limits.ioPriority = ioprio & 0xff;
+    }
+
+    cpu_set_t set;
+    if (sched_getaffinity(pid, sizeof(set), &set) == 0 && CPU_COUNT(&set) < sysconf(_SC_NPROCESSORS_CONF))
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                limits.cpus.append(cpu);
+
+    // Caps of the cgroup v2 the process is in, "0::/path" is its only line
+    QFile cgroupFile(QString("/proc/%1/cgroup").arg(pid));
+    if (!cgroupFile.open(QIODevice::ReadOnly))
+        return limits;
+    auto cgroup = "/sys/fs/cgroup" + QFile::decodeName(cgroupFile.readAll().trimmed().mid(3));
+    QFile memoryFile(cgroup + "/memory.max");
+    if (memoryFile.open(QIODevice::ReadOnly))
+    {
+        auto memoryMax = memoryFile.readAll().trimmed();
+        if (memoryMax != "max")
+            limits.memoryMax = memoryMax;
+    }
+    QFile cpuFile(cgroup + "/cpu.max");
+    if (cpuFile.open(QIODevice::ReadOnly))
+    {
+        auto cpuMax = cpuFile.readAll().trimmed().split(' '); // Quota and period in microseconds
+        if (cpuMax.value(0) != "max" && cpuMax.value(1).toLongLong() > 0)
+            limits.cpuQuota = QString::number(100.0 * cpuMax.value(0).toLongLong() / cpuMax.value(1).toLongLong()) + "%";
+    }
+    return limits;
+}
+
+void ProcessLimits::apply(qint64 pid) const
+{
+    if (nice && setpriority(PRIO_PROCESS, pid, *nice) != 0)
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Process:" << pid << "Can't set nice level" << *nice << strerror(errno);
+    if (ioClass && syscall(SYS_ioprio_set, ioprioWhoProcess, pid, ioClass << ioprioClassShift | ioPriority) != 0)
+        qCWarning(KSYSTEMSTATS_SCRIPTS) << "Process:" << pid << "Can't set I/O priority" << ioPriorityName() << strerror(errno);
+    if (!cpus.isEmpty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : cpus)
+            CPU_SET(cpu, &set);
+        if (sched_setaffinity(pid, sizeof(set), &set) != 0)
+            qCWarning(KSYSTEMSTATS_SCRIPTS) << "Process:" << pid << "Can't set CPU affinity" << cpuList() << strerror(errno);
+    }
+}
+
+
+ProcessTransport::ProcessTransport(const QString &program, QObject *parent) : ScriptTransport(parent), process(this), program(program)
+{
+    connect(&process, &QProcess::readyReadStandardOutput, this, &ScriptTransport::readyRead);
+    connect(&process, &QProcess::stateChanged, this, [this](QProcess::ProcessState newState)
+    {
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Process:" << this->program << "State:" << newState;
+        if (newState == QProcess::ProcessState::Running)
+        {
+            limits.apply(process.processId()); // Inherited by the script when systemd-run replaces itself with it
+            emit started();
+        }
+        else if (newState == QProcess::ProcessState::NotRunning)
+            emit stopped();
+    });
+}
+
+void ProcessTransport::start()
+{
+    if (!limits.needsScope())
+    {
+        process.start(program, {});
+        return;
+    }
+
+    // Memory and CPU caps need a cgroup, a transient scope keeps the process a direct child
+    QStringList arguments { "--user", "--scope", "--quiet", "--collect" };
+    if (!limits.memoryMax.isEmpty())
+        arguments << "-p" << "MemoryMax=" + limits.memoryMax;
+    if (!limits.cpuQuota.isEmpty())
+        arguments << "-p" << "CPUQuota=" + limits.cpuQuota;
+    process.start("systemd-run", arguments << "--" << program);
+}
+
+void ProcessTransport::stop()
+{
+    process.close();
+}
+
+
+SocketTransport::SocketTransport(const QString &socketPath, QObject *parent) : ScriptTransport(parent), socket(this), socketPath(socketPath)
+{
+    connect(&socket, &QLocalSocket::readyRead, this, &ScriptTransport::readyRead);
+    connect(&socket, &QLocalSocket::connected, this, &ScriptTransport::started);
+    connect(&socket, &QLocalSocket::disconnected, this, &SocketTransport::setStopped);
+    connect(&socket, &QLocalSocket::errorOccurred, this, [this](QLocalSocket::LocalSocketError error)
+    {
+        qCDebug(KSYSTEMSTATS_SCRIPTS) << "Socket:" << this->socketPath << "Error:" << error;
+        if (socket.state() == QLocalSocket::UnconnectedState) // Connecting failed, disconnected is not emitted
+            setStopped();
+    });
+}
+
+void SocketTransport::start()
+{
+    active = true;
+    socket.connectToServer(socketPath);
+}
+
+void SocketTransport::stop()
+{
+    socket.abort();
+    setStopped();
+}
+
+void SocketTransport::setStopped()
+{
+    if (std::exchange(active, false))
+        emit stopped();
+}
+
+
+MuxConnection::MuxConnection(ScriptTransport *transport, bool announceChannels, QObject *parent) : QObject(parent), transport(transport), announceChannels(announceChannels)
+{
+    transport->setParent(this);
+    connect(transport, &ScriptTransport::readyRead, this, &MuxConnection::readyRead);
+    connect(transport, &ScriptTransport::started, this, [this]()
+    {
+        running = true; starting = false;
+        for (auto channel = channels.cbegin(); channel != channels.cend(); ++channel)
+        {
+            announce("attach", channel.key());
+            channel.value()->connectionStarted();
+        }
+    });
+    connect(transport, &ScriptTransport::stopped, this, [this]()
+    {
+        running = false; starting = false;
+        input.clear();
+        for (auto& channel : qAsConst(channels))
+            channel->connectionStopped();
+    });
+}
+
+void MuxConnection::attach(const QByteArray &group, MuxTransport *channel)
+{
+    channels.insert(group, channel);
+    if (running)
+        announce("attach", group);
+    else if (!starting)
+    {
+        starting = true;
+        transport->start();
+    }
+}
+
+void MuxConnection::detach(const QByteArray &group, MuxTransport *channel)
+{
+    if (channels.value(group) != channel)
+        return;
+    channels.remove(group);
+    if (running)
+        announce("detach", group);
+    if (channels.isEmpty()) // Nobody uses connection anymore
+        transport->stop();
+}
+
+void MuxConnection::announce(const char *command, const QByteArray &group)
+{
+    if (announceChannels)
+        transport->device().write(QByteArray("*\t") + command + '\t' + group + '\n');
+}
+
+void MuxConnection::write(const QByteArray &group, const char *data, qint64 size)
+{
+    // Prefix every line with the group
+    QByteArray prefixed;
+    for (auto line = data, end = data + size; line < end;)
+    {
+        auto newline = static_cast<const char*>(memchr(line, '\n', end - line));
+        auto lineEnd = newline ? newline + 1 : end;
+        prefixed += group + '\t';
+        prefixed.append(line, lineEnd - line);
+        line = lineEnd;
+    }
+    transport->device().write(prefixed);
+}
+
+void MuxConnection::readyRead()
+{
+    auto time = transport->arrivalTime();
+    input.readFrom(transport->device());
+    while (input.hasLine())
+    {
+        auto line = input.takeLine();
+        if (announceChannels && line.starts_with("*\tdetached\t")) // Script exited on the other side
+        {
+            line.remove_prefix(strlen("*\tdetached\t"));
+            if (auto channel = channels.value(QByteArray(line.data(), line.size())))
+                channel->connectionStopped();
+            continue;
+        }
+        auto separator = line.find('\t');
+        auto channel = channels.value(QByteArray(line.data(), separator == std::string_view::npos ? line.size() : separator));
+        if (channel && separator != std::string_view::npos)
+        {
+            channel->arrival = time;
+            channel->deliver(line.substr(separator + 1));
+        }
+        else
+            qCDebug(KSYSTEMSTATS_SCRIPTS) << "Unexpected multiplexed reply:" << QByteArray(line.data(), line.size());
+    }
+}
+
+
+MuxTransport::MuxTransport(MuxConnection *connection, const QString &group, QObject *parent) : ScriptTransport(parent), connection(connection), group(group.toLocal8Bit()),
+    channel([this](const char *data, qint64 size) { this->connection->write(this->group, data, size); }, this)
+{
+}
+
+MuxTransport::~MuxTransport()
+{
+    connection->detach(group, this);
+}
+
+void MuxTransport::start()
+{
+    active = true;
+    connection->attach(group, this);
+    if (connection->isRunning()) // Report asynchronously, like other transports
+        QTimer::singleShot(0, this, [this]() { if (active) emit started(); });
+}
+
+void MuxTransport::stop()
+{
+    if (!std::exchange(active, false))
+        return;
+    connection->detach(group, this);
+    channel.input.clear();
+    emit stopped();
+}
+
+void MuxTransport::connectionStarted()
+{
+    if (active)
+        emit started();
+}
+
+void MuxTransport::connectionStopped()
+{
+    if (!std::exchange(active, false))
+        return;
+    channel.input.clear();
+    emit stopped();
+}
+
+void MuxTransport::deliver(std::string_view line)
+{
+    channel.input.append(line.data(), line.size());
+    channel.input.append('\n');
+    emit readyRead();
+}
+
+TransportWorker::TransportWorker(ScriptTransport *transport) : transport(transport)
+{
+    transport->setParent(this);
+    connect(transport, &ScriptTransport::started, this, [this]() { emit started(run, this->transport->processId()); });
+    connect(transport, &ScriptTransport::stopped, this, [this]() { emit stopped(run); });
+    connect(transport, &ScriptTransport::readyRead, this, [this]()
+    {
+        auto time = this->transport->arrivalTime(); // Before reading, which may take a while for large chunks
+        emit received(run, this->transport->device().readAll(), time);
+    });
+}
+
+void TransportWorker::start(quint64 run)
+{
+    this->run = run;
+    transport->start();
+}
+
+void TransportWorker::stop()
+{
+    transport->stop();
+}
+
+void TransportWorker::write(const QByteArray &data)
+{
+    transport->device().write(data);
+}
+
+
+ThreadedTransport::ThreadedTransport(ScriptTransport *transport, QThread *thread, QObject *parent) : ScriptTransport(parent), worker(new TransportWorker(transport)),
+    channel([this](const char *data, qint64 size)
+    {
+        QByteArray buffer(data, size);
+        QMetaObject::invokeMethod(worker, [worker = worker, buffer]() { worker->write(buffer); });
+    }, this),
+    multiplexed(transport->isMultiplexed())
+{
+    worker->moveToThread(thread);
+    connect(worker, &TransportWorker::started, this, &ThreadedTransport::workerStarted);
+    connect(worker, &TransportWorker::stopped, this, &ThreadedTransport::workerStopped);
+    connect(worker, &TransportWorker::received, this, &ThreadedTransport::workerReceived);
+}
+
+ThreadedTransport::~ThreadedTransport()
+{
+    worker->deleteLater(); // Stops the transport on the I/O thread
+}
+
+void ThreadedTransport::start()
+{
+    active = true;
+    QMetaObject::invokeMethod(worker, [worker = worker, run = ++run]() { worker->start(run); });
+}
+
+void ThreadedTransport::stop()
+{
+    if (!std::exchange(active, false))
+        return;
+    QMetaObject::invokeMethod(worker, [worker = worker]() { worker->stop(); });
+    channel.input.clear();
+    pid = 0;
+    emit stopped(); // Right away, like when stopping other transports
+}
+
+void ThreadedTransport::setLimits(const ProcessLimits &limits)
+{
+    QMetaObject::invokeMethod(worker, [worker = worker, limits]() { worker->setLimits(limits); }); // Queued before a following start
+}
+
+void ThreadedTransport::workerStarted(quint64 run, qint64 processId)
+{
+    if (run != this->run || !active)
+        return;
+    pid = processId;
+    emit started();
+}
+
+void ThreadedTransport::workerStopped(quint64 run)
+{
+    if (run != this->run || !std::exchange(active, false))
+        return;
+    channel.input.clear();
+    pid = 0;
+    emit stopped();
+}
+
+void ThreadedTransport::workerReceived(quint64 run, const QByteArray &data, qint64 time)
+{
+    if (run != this->run || !active)
+        return;
+    if (channel.input.isEmpty()) // Usually everything was read already, share the chunk instead of copying it
+        channel.input = data;
+    else
+        channel.input += data;
+    arrival = time;
+    emit readyRead();
+}
@@ -0,0 +1,263 @@
+/*
+    SPDX-FileCopyrightText: 2023 Mikhail Morozov <2002morozik@gmail.com>
+
+    SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only OR LicenseRef-KDE-Accepted-GPL
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <functional>
+#include <optional>
+#include <string_view>
+
+#include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QLocalSocket>
+#include <QObject>
+#include <QProcess>
+#include <QThread>
+
+
+// Accumulates script output and splits it into lines or fixed size records, reusing the same storage between reads
+class LineBuffer
+{
+public:
+    void readFrom(QIODevice &device);
+    bool hasLine();
+    std::string_view takeLine(); // Valid until next readFrom, call only if hasLine returned true
+    qsizetype size() const { return end - begin; }
+    std::string_view take(qsizetype size); // Valid until next readFrom, call only if size is available
+    void clear();
+
+private:
+    QByteArray buffer;
+    qsizetype begin = 0; // Start of unconsumed data
+    qsizetype end = 0; // End of received data
+    qsizetype scanned = 0; // Data before this position doesn't contain a newline, or this is the found newline
+};
+
+
+// Device of a transport that doesn't own a connection, received data is appended to input and written data passed on
+class RelayDevice : public QIODevice
+{
+public:
+    explicit RelayDevice(std::function<void(const char *data, qint64 size)> writer, QObject *parent = nullptr);
+
+    qint64 bytesAvailable() const override { return input.size() + QIODevice::bytesAvailable(); }
+    bool isSequential() const override { return true; }
+
+    QByteArray input;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override;
+    qint64 writeData(const char *data, qint64 size) override;
+
+private:
+    std::function<void(const char *data, qint64 size)> writer;
+};
+
+
+// Scheduling and resource limits of a script process
+struct ProcessLimits
+{
+    std::optional<int> nice;
+    int ioClass = 0; // Kernel IOPRIO_CLASS_* value, 0 to keep the inherited one
+    int ioPriority = 4; // 0 is highest, within the class
+    QList<int> cpus; // Allowed CPUs, empty for all
+    QString memoryMax; // As systemd MemoryMax= property, like "512M"
+    QString cpuQuota; // As systemd CPUQuota= property, like "20%"
+
+    bool needsScope() const { return !memoryMax.isEmpty() || !cpuQuota.isEmpty(); }
+    QString ioPriorityName() const;
+    QString cpuList() const;
+
+    static ProcessLimits fromFile(const QString &path); // Missing file or keys mean no limits
+    static ProcessLimits fromProcess(qint64 pid); // Limits currently applied, memory and CPU caps in bytes and percent
+    void apply(qint64 pid) const; // Everything except memory and CPU caps, which need a scope
+};
+
+
+// Connection to a script, requests are written to and replies read from its device
+class ScriptTransport : public QObject
+{
+    Q_OBJECT
+
+public:
+    using QObject::QObject;
+
+    virtual QIODevice &device() = 0;
+    virtual void start() = 0;
+    virtual void stop() = 0; // Emits stopped if running
+    virtual bool isMultiplexed() const { return false; } // Only whole lines can be sent
+    virtual qint64 processId() const { return 0; }
+    virtual void setLimits(const ProcessLimits &limits) { Q_UNUSED(limits) } // Applied on next start, if there is a process
+    virtual qint64 arrivalTime() const { return monotonicTime(); } // When data available at readyRead was received
+
+    static qint64 monotonicTime(); // Nanoseconds of the clock QElapsedTimer uses
+
+signals:
+    void started();
+    void stopped();
+    void readyRead();
+};
+
+
+// Script running as a child process, communicating via stdin and stdout
+class ProcessTransport : public ScriptTransport
+{
+    Q_OBJECT
+
+public:
+    ProcessTransport(const QString &program, QObject *parent = nullptr);
+
+    QIODevice &device() override { return process; }
+    void start() override;
+    void stop() override;
+    qint64 processId() const override { return process.processId(); }
+    void setLimits(const ProcessLimits &limits) override { this->limits = limits; }
+
+private:
+    QProcess process;
+    QString program;
+    ProcessLimits limits;
+};
+
+
+// Script served by a daemon listening on a Unix domain socket
+class SocketTransport : public ScriptTransport
+{
+    Q_OBJECT
+
+public:
+    SocketTransport(const QString &socketPath, QObject *parent = nullptr);
+
+    QIODevice &device() override { return socket; }
+    void start() override;
+    void stop() override;
+
+private:
+    QLocalSocket socket;
+    QString socketPath;
+    bool active = false; // Started and stopped wasn't emitted yet
+
+    void setStopped();
+};
+
+
+class MuxTransport;
+
+// Connection shared by several scripts, each line is prefixed by the group of the script it belongs to
+class MuxConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Takes ownership of transport, with announceChannels attaching and detaching is reported to the other side
+    MuxConnection(ScriptTransport *transport, bool announceChannels = false, QObject *parent = nullptr);
+
+    bool isRunning() const { return running; }
+    void attach(const QByteArray &group, MuxTransport *channel); // Starts connection if needed
+    void detach(const QByteArray &group, MuxTransport *channel);
+    void write(const QByteArray &group, const char *data, qint64 size);
+
+private:
+    ScriptTransport *transport;
+    LineBuffer input;
+    QHash<QByteArray, MuxTransport*> channels;
+    bool running = false;
+    bool starting = false;
+    bool announceChannels;
+
+    void announce(const char *command, const QByteArray &group);
+    void readyRead();
+};
+
+
+// Script multiplexed over a shared connection
+class MuxTransport : public ScriptTransport
+{
+    Q_OBJECT
+
+    friend MuxConnection;
+
+public:
+    MuxTransport(MuxConnection *connection, const QString &group, QObject *parent = nullptr);
+    ~MuxTransport();
+
+    QIODevice &device() override { return channel; }
+    void start() override;
+    void stop() override;
+    bool isMultiplexed() const override { return true; }
+    qint64 arrivalTime() const override { return arrival; }
+
+private:
+    MuxConnection *connection;
+    QByteArray group;
+    RelayDevice channel;
+    qint64 arrival = 0; // Of the connection data the delivered line was in
+    bool active = false; // Started and stopped wasn't emitted yet
+
+    void connectionStarted();
+    void connectionStopped();
+    void deliver(std::string_view line);
+};
+
+
+// Owns a transport on the I/O thread and relays its data and state to a ThreadedTransport, each run is numbered by it
+class TransportWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TransportWorker(ScriptTransport *transport); // Takes ownership of transport
+
+    void start(quint64 run);
+    void stop();
+    void write(const QByteArray &data);
+    void setLimits(const ProcessLimits &limits) { transport->setLimits(limits); }
+
+signals:
+    void started(quint64 run, qint64 processId);
+    void stopped(quint64 run);
+    void received(quint64 run, const QByteArray &data, qint64 time); // Time of arrival on the I/O thread
+
+private:
+    ScriptTransport *transport;
+    quint64 run = 0;
+};
+
+
+// Transport running on the I/O thread, so waiting for and reading script output doesn't block the main thread
+class ThreadedTransport : public ScriptTransport
+{
+    Q_OBJECT
+
+public:
+    ThreadedTransport(ScriptTransport *transport, QThread *thread, QObject *parent = nullptr); // Takes ownership of transport
+    ~ThreadedTransport();
+
+    QIODevice &device() override { return channel; }
+    void start() override;
+    void stop() override;
+    bool isMultiplexed() const override { return multiplexed; }
+    qint64 processId() const override { return pid; }
+    void setLimits(const ProcessLimits &limits) override;
+    qint64 arrivalTime() const override { return arrival; }
+
+private:
+    TransportWorker *worker; // Lives on the I/O thread, only accessed through queued calls
+    RelayDevice channel;
+    bool multiplexed;
+    quint64 run = 0; // Events of earlier runs are ignored
+    bool active = false; // Started and stopped wasn't emitted yet
+    qint64 pid = 0;
+    qint64 arrival = 0;
+
+    void workerStarted(quint64 run, qint64 processId);
+    void workerStopped(quint64 run);
+    void workerReceived(quint64 run, const QByteArray &data, qint64 time);
+};
+
+#endif